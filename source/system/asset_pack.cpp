@@ -0,0 +1,238 @@
+#include "asset_pack.hpp"
+#include <png.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace hcc
+{
+
+namespace
+{
+
+struct AssetPackHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t count;
+    std::uint32_t names_size;
+};
+
+struct AssetPackEntry
+{
+    std::uint32_t name_offset, name_size;
+    std::uint32_t format, width, height;
+    std::uint8_t tint[4];
+    std::uint64_t data_offset;
+};
+
+template <typename T>
+void write_values(std::ofstream& out, const T *values, std::size_t count)
+{
+    out.write(reinterpret_cast<const char *>(values), sizeof(T) * count);
+}
+
+template <typename T>
+bool read_values(const std::uint8_t *& p, const std::uint8_t *end, T *values, std::size_t count)
+{
+    if (std::size_t(end - p) < sizeof(T) * count)
+        return false;
+    std::memcpy(values, p, sizeof(T) * count);
+    p += sizeof(T) * count;
+    return true;
+}
+
+std::size_t align4(std::size_t offset)
+{
+    return (offset + 3) & ~std::size_t(3);
+}
+
+}
+
+unsigned image_format_bytes(std::uint32_t format)
+{
+    switch (format)
+    {
+    case IMAGE_FORMAT_ALPHA: return 1;
+    case IMAGE_FORMAT_RGB: return 3;
+    default: return 4;
+    }
+}
+
+DecodedImage decode_png(const char *path)
+{
+    auto fp = std::fopen(path, "rb");
+    if (!fp)
+    {
+        std::cerr << "error loading " << path << std::endl;
+        std::abort();
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+
+    if (setjmp(png_jmpbuf(png)))
+    {
+        std::cerr << "error loading " << path << std::endl;
+        std::abort();
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    auto width = png_get_image_width(png, info);
+    auto height = png_get_image_height(png, info);
+    auto color_type = png_get_color_type(png, info);
+    auto bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth != 8 || (color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGBA))
+    {
+        std::cerr << "unsupported image format: " << path << std::endl;
+        std::abort();
+    }
+
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+
+    if (color_type == PNG_COLOR_TYPE_RGB)
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+
+    png_read_update_info(png, info);
+
+    auto rows = static_cast<png_bytep *>(std::malloc(sizeof(png_bytep) * height));
+    for (decltype(height) i = 0; i < height; ++i)
+        rows[i] = static_cast<png_byte *>(std::malloc(png_get_rowbytes(png, info)));
+
+    png_read_image(png, rows);
+
+    std::fclose(fp);
+
+    DecodedImage decoded;
+    decoded.width = width;
+    decoded.height = height;
+    decoded.rgba.resize(width * height * 4);
+    for (decltype(height) i = 0; i < height; ++i)
+    {
+        std::memcpy(&decoded.rgba[(height - i - 1) * width * 4], rows[i], width * 4);
+        std::free(rows[i]);
+    }
+    std::free(rows);
+    png_destroy_read_struct(&png, &info, nullptr);
+    return decoded;
+}
+
+BakedImage bake_image(const std::string& name, const DecodedImage& image)
+{
+    BakedImage baked;
+    baked.name = name;
+    baked.width = image.width;
+    baked.height = image.height;
+    auto pixel_count = std::size_t(image.width) * image.height;
+    auto& rgba = image.rgba;
+    bool opaque = true, one_color = true, any_visible = false;
+    for (std::size_t i = 0; i < pixel_count; ++i)
+    {
+        auto p = &rgba[i * 4];
+        opaque = opaque && p[3] == 255;
+        if (p[3] == 0)
+            continue;
+        if (!any_visible)
+            baked.tint = {{p[0], p[1], p[2]}};
+        any_visible = true;
+        one_color = one_color && p[0] == baked.tint[0] && p[1] == baked.tint[1] && p[2] == baked.tint[2];
+    }
+    baked.format = opaque ? IMAGE_FORMAT_RGB : one_color ? IMAGE_FORMAT_ALPHA : IMAGE_FORMAT_RGBA;
+    if (baked.format != IMAGE_FORMAT_ALPHA)
+        baked.tint = {};
+    if (baked.format == IMAGE_FORMAT_RGBA)
+    {
+        baked.pixels = rgba;
+        return baked;
+    }
+    auto bytes = image_format_bytes(baked.format);
+    baked.pixels.resize(pixel_count * bytes);
+    for (std::size_t i = 0; i < pixel_count; ++i)
+        std::memcpy(&baked.pixels[i * bytes], &rgba[i * 4 + (baked.format == IMAGE_FORMAT_ALPHA ? 3 : 0)], bytes);
+    return baked;
+}
+
+bool save_asset_pack(const std::string& path, const std::vector<BakedImage>& images)
+{
+    std::string names;
+    for (auto& image : images)
+        names += image.name;
+    AssetPackHeader header{{'H', 'C', 'C', 'A'}, ASSET_PACK_VERSION, std::uint32_t(images.size()), std::uint32_t(names.size())};
+    std::vector<AssetPackEntry> entries;
+    std::size_t name_offset = 0;
+    auto data_offset = align4(sizeof(header) + sizeof(AssetPackEntry) * images.size() + names.size());
+    for (auto& image : images)
+    {
+        entries.push_back({std::uint32_t(name_offset), std::uint32_t(image.name.size()), image.format, image.width, image.height,
+                           {image.tint[0], image.tint[1], image.tint[2], 0}, data_offset});
+        name_offset += image.name.size();
+        data_offset = align4(data_offset + image.pixels.size());
+    }
+
+    auto tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        write_values(out, &header, 1);
+        write_values(out, entries.data(), entries.size());
+        write_values(out, names.data(), names.size());
+        for (std::size_t i = 0; i < images.size(); ++i)
+        {
+            while (std::size_t(out.tellp()) < entries[i].data_offset)
+                out.put(0);
+            write_values(out, images[i].pixels.data(), images[i].pixels.size());
+        }
+        if (!out)
+        {
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool read_asset_pack(const std::uint8_t *data, std::size_t size, std::unordered_map<std::string, PackedImage>& images)
+{
+    if (!data)
+        return false;
+    auto p = data, end = data + size;
+    AssetPackHeader header;
+    if (!read_values(p, end, &header, 1) ||
+        std::memcmp(header.magic, "HCCA", 4) != 0 ||
+        header.version != ASSET_PACK_VERSION)
+        return false;
+    // the count comes from the file, it has to fit in it before anything is allocated
+    if (header.count > std::size_t(end - p) / sizeof(AssetPackEntry))
+        return false;
+    std::vector<AssetPackEntry> entries(header.count);
+    if (!read_values(p, end, entries.data(), entries.size()) || std::size_t(end - p) < header.names_size)
+        return false;
+    auto names = reinterpret_cast<const char *>(p);
+
+    std::unordered_map<std::string, PackedImage> read;
+    for (auto& entry : entries)
+    {
+        auto bytes = std::uint64_t(entry.width) * entry.height * image_format_bytes(entry.format);
+        if (entry.format >= IMAGE_FORMAT_COUNT ||
+            std::uint64_t(entry.name_offset) + entry.name_size > header.names_size ||
+            entry.data_offset > size || bytes > size - entry.data_offset)
+            return false;
+        PackedImage image;
+        image.format = entry.format;
+        image.width = entry.width;
+        image.height = entry.height;
+        image.tint = {{entry.tint[0], entry.tint[1], entry.tint[2]}};
+        image.pixels = data + entry.data_offset;
+        read[std::string(names + entry.name_offset, entry.name_size)] = image;
+    }
+    for (auto& image : read)
+        images[image.first] = image.second;
+    return true;
+}
+
+}
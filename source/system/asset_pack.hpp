@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hcc
+{
+
+constexpr std::uint32_t ASSET_PACK_VERSION = 1;
+
+constexpr std::uint32_t IMAGE_FORMAT_ALPHA = 0;
+constexpr std::uint32_t IMAGE_FORMAT_RGB = 1;
+constexpr std::uint32_t IMAGE_FORMAT_RGBA = 2;
+constexpr std::size_t IMAGE_FORMAT_COUNT = 3;
+
+unsigned image_format_bytes(std::uint32_t format);
+
+// RGBA pixels with the bottom row first, the way they are uploaded
+struct DecodedImage
+{
+    unsigned width{}, height{};
+    std::vector<std::uint8_t> rgba;
+};
+
+DecodedImage decode_png(const char *path);
+
+// An image in the smallest format that keeps its pixels: RGB when it is opaque,
+// alpha only when all its visible pixels have one color, which becomes the tint.
+struct BakedImage
+{
+    std::string name;
+    std::uint32_t format{};
+    unsigned width{}, height{};
+    std::array<std::uint8_t, 3> tint{};
+    std::vector<std::uint8_t> pixels;
+};
+
+BakedImage bake_image(const std::string& name, const DecodedImage& image);
+bool save_asset_pack(const std::string& path, const std::vector<BakedImage>& images);
+
+// an image whose pixels point into a mapped pack
+struct PackedImage
+{
+    std::uint32_t format{};
+    unsigned width{}, height{};
+    std::array<std::uint8_t, 3> tint{};
+    const std::uint8_t *pixels{};
+};
+
+// adds the images of a pack by name, fails without adding any if the pack is invalid
+bool read_asset_pack(const std::uint8_t *data, std::size_t size, std::unordered_map<std::string, PackedImage>& images);
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+namespace hcc
+{
+
+struct Shelf
+{
+    unsigned y{}, height{}, width{};
+};
+
+struct ShelfPacker
+{
+    unsigned width{}, height{};
+    std::vector<Shelf> shelves;
+
+    ShelfPacker() = default;
+    ShelfPacker(unsigned width, unsigned height) : width(width), height(height) { }
+
+    // picks the lowest shelf the rectangle fits on or opens a new one
+    bool insert(unsigned w, unsigned h, unsigned& x, unsigned& y)
+    {
+        Shelf *best = nullptr;
+        for (auto& shelf : shelves)
+            if (h <= shelf.height && shelf.width + w <= width && (!best || shelf.height < best->height))
+                best = &shelf;
+        if (!best)
+        {
+            auto top = shelves.empty() ? 0 : shelves.back().y + shelves.back().height;
+            if (w > width || top + h > height)
+                return false;
+            shelves.push_back({top, h, 0});
+            best = &shelves.back();
+        }
+        x = best->width;
+        y = best->y;
+        best->width += w;
+        return true;
+    }
+};
+
+// where a rectangle went, new_page is set when the page was opened for it
+struct AtlasPlacement
+{
+    std::size_t page{};
+    unsigned x{}, y{};
+    bool new_page{};
+};
+
+// Finds room on an existing page or opens a new one, doubling the width and the
+// height of the page separately for oversized rectangles. Page is anything with a
+// ShelfPacker named packer. Fails when the page would be larger than max_size.
+template <typename Page>
+bool place_in_atlas(
+    std::vector<Page>& atlas, unsigned page_width, unsigned page_height, unsigned max_size,
+    unsigned width, unsigned height, AtlasPlacement& placement)
+{
+    placement = {};
+    for (; placement.page < atlas.size(); ++placement.page)
+        if (atlas[placement.page].packer.insert(width, height, placement.x, placement.y))
+            return true;
+    while (page_width < width)
+        page_width *= 2;
+    while (page_height < height)
+        page_height *= 2;
+    if (page_width > max_size || page_height > max_size)
+        return false;
+    Page page;
+    page.packer = ShelfPacker(page_width, page_height);
+    page.packer.insert(width, height, placement.x, placement.y);
+    atlas.push_back(std::move(page));
+    placement.new_page = true;
+    return true;
+}
+
+struct AtlasCoords
+{
+    float s0{}, t0{}, s1{}, t1{};
+};
+
+// texture coordinates of a rectangle on a page of the given size
+inline AtlasCoords atlas_coords(unsigned page_width, unsigned page_height, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+    return {float(x) / page_width, float(y) / page_height, float(x + width) / page_width, float(y + height) / page_height};
+}
+
+}
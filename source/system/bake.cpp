@@ -0,0 +1,35 @@
+#include "asset_pack.hpp"
+#include <iostream>
+
+// Converts PNG images into an asset pack for load_pack(), each image named by its path as given:
+// hcc_bake <pack> <image.png>...
+int main(int argc, char **argv)
+{
+    using namespace hcc;
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <pack> <image.png>..." << std::endl;
+        return 1;
+    }
+    static const char *const format_names[] = {"alpha", "rgb", "rgba"};
+    std::vector<BakedImage> images;
+    std::size_t rgba_bytes = 0, packed_bytes = 0;
+    for (int i = 2; i < argc; ++i)
+    {
+        auto decoded = decode_png(argv[i]);
+        images.push_back(bake_image(argv[i], decoded));
+        auto& baked = images.back();
+        rgba_bytes += decoded.rgba.size();
+        packed_bytes += baked.pixels.size();
+        std::cout << baked.name << ": " << baked.width << "x" << baked.height << " " << format_names[baked.format]
+                  << ", " << baked.pixels.size() << " bytes" << std::endl;
+    }
+    if (!save_asset_pack(argv[1], images))
+    {
+        std::cerr << "could not write " << argv[1] << std::endl;
+        return 1;
+    }
+    std::cout << "baked " << images.size() << " images into " << argv[1] << ", " << packed_bytes << " bytes of pixels instead of "
+              << rgba_bytes << " as RGBA" << std::endl;
+    return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace hcc
+{
+
+inline double to_linear(double c)
+{
+    return c > 0.04045 ? std::pow((c + 0.055) / 1.055, 2.4) : c / 12.92;
+}
+
+inline double to_srgb(double c)
+{
+    return c > 0.0031308 ? 1.055 * std::pow(c, 1 / 2.4) - 0.055 : c * 12.92;
+}
+
+// The source color and alpha that make a GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+// blend over an sRGB destination land on the linear space mix of the two,
+// the same as linearBlend() in the direct rendering shaders.
+inline std::array<double, 4> linear_blend(const std::array<double, 3>& destination, const std::array<double, 3>& color, double alpha)
+{
+    std::array<double, 3> target;
+    double a = alpha;
+    for (std::size_t i = 0; i < 3; ++i)
+    {
+        target[i] = to_srgb(to_linear(destination[i]) * (1 - alpha) + to_linear(color[i]) * alpha);
+        auto up = (target[i] - destination[i]) / std::max(1 - destination[i], 0.001);
+        auto down = (destination[i] - target[i]) / std::max(destination[i], 0.001);
+        a = std::max(a, std::max(up, down));
+    }
+    a = std::min(a, 1.0);
+    std::array<double, 4> source;
+    for (std::size_t i = 0; i < 3; ++i)
+        source[i] = std::min(std::max(destination[i] + (target[i] - destination[i]) / a, 0.0), 1.0);
+    source[3] = a;
+    return source;
+}
+
+}
@@ -0,0 +1,1153 @@
+#include "font.hpp"
+#include "parallel.hpp"
+#include FT_GLYPH_H
+#include FT_OUTLINE_H
+#include FT_BITMAP_H
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <tuple>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace hcc
+{
+
+namespace
+{
+
+constexpr std::uint32_t FONT_CACHE_VERSION = 3;
+
+struct FontCacheHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t key;
+    std::int32_t precision, ascender, descender, height, center, baseline_center;
+    std::uint32_t char_count, page_count, kerning_count;
+};
+
+struct FontCachePage
+{
+    std::uint32_t width, height;
+};
+
+struct FontCacheChar
+{
+    std::uint32_t code;
+    std::int32_t bearing_x, bearing_y, advance_x;
+};
+
+struct FontCacheGlyph
+{
+    std::int32_t img_x, img_y, img_width, img_height, page;
+};
+
+struct FontCacheKerning
+{
+    std::uint32_t pair;
+    std::int32_t value;
+};
+
+std::uint64_t hash_bytes(const void *data, std::size_t size, std::uint64_t hash = 14695981039346656037ull)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+struct RenderedChar
+{
+    FontChar metrics;
+    FT_Pos bearing_y{};
+    std::vector<FontImage> variants;
+};
+
+template <typename T>
+void write_values(std::ofstream& out, const T *values, std::size_t count)
+{
+    out.write(reinterpret_cast<const char *>(values), sizeof(T) * count);
+}
+
+template <typename T>
+bool read_values(const std::uint8_t *& p, const std::uint8_t *end, T *values, std::size_t count)
+{
+    if (std::size_t(end - p) < sizeof(T) * count)
+        return false;
+    std::memcpy(values, p, sizeof(T) * count);
+    p += sizeof(T) * count;
+    return true;
+}
+
+// checks the count against the bytes left before allocating anything
+template <typename T>
+bool read_vector(const std::uint8_t *& p, const std::uint8_t *end, std::vector<T>& values, std::size_t count)
+{
+    if (count > std::size_t(end - p) / sizeof(T))
+        return false;
+    values.resize(count);
+    return read_values(p, end, values.data(), count);
+}
+
+void make_dirs(const std::string& path)
+{
+    for (auto slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    mkdir(path.c_str(), 0755);
+}
+
+}
+
+constexpr std::uint16_t GlyphTable::NONE;
+
+MappedFile::MappedFile(const std::string& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            data = static_cast<const std::uint8_t *>(addr);
+            size = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        munmap(const_cast<std::uint8_t *>(data), size);
+}
+
+FontFile::FontFile(const std::string& path) : path(path), file(path)
+{
+    if (file.data)
+        hash = hash_bytes(file.data, file.size);
+}
+
+FontFile::~FontFile()
+{
+    for (auto face : faces)
+        FT_Done_Face(face);
+}
+
+bool FontFile::open_faces(FT_Library freetype, unsigned count)
+{
+    if (!file.data)
+        return false;
+    while (faces.size() < count)
+    {
+        FT_Face face;
+        if (FT_New_Memory_Face(freetype, file.data, FT_Long(file.size), 0, &face) != 0)
+            return false;
+        faces.push_back(face);
+    }
+    return true;
+}
+
+std::vector<FT_Size> FontFile::new_sizes(unsigned count)
+{
+    std::vector<FT_Size> sizes;
+    for (unsigned i = 0; i < count && i < faces.size(); ++i)
+    {
+        FT_Size size;
+        if (FT_New_Size(faces[i], &size) != 0)
+            break;
+        FT_Activate_Size(size);
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+void done_sizes(const std::vector<FT_Size>& sizes)
+{
+    for (auto size : sizes)
+        FT_Done_Size(size);
+}
+
+std::uint16_t GlyphTable::add_char(std::uint32_t code, const FontChar& ch)
+{
+    auto index = add_sparse_char(code, ch);
+    dense_chars = chars.size();
+    return index;
+}
+
+std::uint16_t GlyphTable::add_sparse_char(std::uint32_t code, const FontChar& ch)
+{
+    std::uint16_t index;
+    if (free_chars.empty())
+    {
+        index = std::uint16_t(chars.size());
+        chars.push_back(ch);
+        glyphs.resize(chars.size() * precision);
+    }
+    else
+    {
+        index = free_chars.back();
+        free_chars.pop_back();
+        chars[index] = ch;
+    }
+    if (code < latin1.size())
+        latin1[code] = index;
+    else
+        others.insert(std::upper_bound(begin(others), end(others), std::make_pair(code, NONE)), {code, index});
+    return index;
+}
+
+void GlyphTable::remove_sparse_char(std::uint32_t code)
+{
+    auto index = find(code);
+    if (index == NONE || index < dense_chars)
+        return;
+    if (code < latin1.size())
+        latin1[code] = NONE;
+    else
+        others.erase(std::lower_bound(begin(others), end(others), std::make_pair(code, std::uint16_t(0))));
+    for (auto it = begin(sparse_kerning); it != end(sparse_kerning);)
+        if (it->first >> 16 == index || (it->first & 0xffff) == index)
+            it = sparse_kerning.erase(it);
+        else
+            ++it;
+    if (index < kerns_left.size())
+        kerns_left[index] = false;
+    free_chars.push_back(index);
+}
+
+std::uint16_t GlyphTable::find(std::uint32_t code) const
+{
+    if (code < latin1.size())
+        return latin1[code];
+    auto it = std::lower_bound(begin(others), end(others), std::make_pair(code, std::uint16_t(0)));
+    return it != end(others) && it->first == code ? it->second : NONE;
+}
+
+namespace
+{
+
+// adds a row of bytes to 16-bit column sums
+void add_row(std::uint16_t *sums, const std::uint8_t *row, unsigned width)
+{
+    unsigned x = 0;
+#if defined(__SSE2__)
+    auto zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+        auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x));
+        auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x + 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16)
+    {
+        auto v = vld1q_u8(row + x);
+        vst1q_u16(sums + x, vaddw_u8(vld1q_u16(sums + x), vget_low_u8(v)));
+        vst1q_u16(sums + x + 8, vaddw_u8(vld1q_u16(sums + x + 8), vget_high_u8(v)));
+    }
+#endif
+    for (; x < width; ++x)
+        sums[x] += row[x];
+}
+
+}
+
+ColumnSums sum_columns(FT_Bitmap bitmap, unsigned n, unsigned y_offset)
+{
+    ColumnSums sums;
+    sums.n = n;
+    sums.width = bitmap.width;
+    sums.height = (bitmap.rows + y_offset + (n - 1)) / n;
+    sums.sums.assign(std::size_t(sums.width) * sums.height, 0);
+    for (unsigned gy = 0; gy < sums.height; ++gy)
+        for (unsigned sy = std::max(gy * n, y_offset) - y_offset, msy = std::min((gy + 1) * n - y_offset, bitmap.rows); sy < msy; ++sy)
+            add_row(sums.sums.data() + std::size_t(gy) * sums.width, bitmap.buffer + std::size_t(sy) * bitmap.pitch, sums.width);
+    return sums;
+}
+
+FontImage downscale(const ColumnSums& sums, unsigned offset)
+{
+    auto n = sums.n;
+    FontImage g{(sums.width + offset + (n - 1)) / n, sums.height};
+    std::vector<std::uint32_t> prefix(sums.width + 1);
+    for (unsigned gy = 0; gy < g.height; ++gy)
+    {
+        auto row = sums.sums.data() + std::size_t(gy) * sums.width;
+        for (unsigned x = 0; x < sums.width; ++x)
+            prefix[x + 1] = prefix[x] + row[x];
+        for (unsigned gx = 0; gx < g.width; ++gx)
+        {
+            auto s = prefix[std::min((gx + 1) * n - offset, sums.width)] - prefix[std::max(gx * n, offset) - offset];
+            g.alpha[gx + gy * g.width] = (s + (n * n) / 2) / (n * n);
+        }
+    }
+    return g;
+}
+
+FontImage downscale(FT_Bitmap bitmap, unsigned n, unsigned offset, unsigned y_offset)
+{
+    return downscale(sum_columns(bitmap, n, y_offset), offset);
+}
+
+void blit(FontImage& dst, unsigned dx, unsigned dy, const FontImage& src)
+{
+    if (dx >= dst.width)
+        return;
+    for (auto y = dy; y < std::min(dy + src.height, dst.height); ++y)
+        std::copy_n(src.alpha.data() + (y - dy) * src.width, std::min(src.width, dst.width - dx), dst.alpha.begin() + dx + y * dst.width);
+}
+
+bool SkylinePacker::insert(unsigned w, unsigned h, unsigned& x, unsigned& y)
+{
+    auto best = skyline.size();
+    unsigned best_y{}, best_top = ~0u;
+    for (std::size_t i = 0; i < skyline.size() && skyline[i].x + w <= width; ++i)
+    {
+        unsigned top = 0;
+        for (auto j = i; j < skyline.size() && skyline[j].x < skyline[i].x + w; ++j)
+            top = std::max(top, skyline[j].y);
+        if (top + h <= height && top + h < best_top)
+        {
+            best = i;
+            best_y = top;
+            best_top = top + h;
+        }
+    }
+    if (best == skyline.size())
+        return false;
+    x = skyline[best].x;
+    y = best_y;
+
+    // the new node covers the nodes under the rectangle and shortens the one it partly overlaps
+    auto right = x + w;
+    auto covered = best;
+    while (covered < skyline.size() && skyline[covered].x + skyline[covered].width <= right)
+        ++covered;
+    if (covered < skyline.size() && skyline[covered].x < right)
+    {
+        skyline[covered].width -= right - skyline[covered].x;
+        skyline[covered].x = right;
+    }
+    skyline.erase(begin(skyline) + best, begin(skyline) + covered);
+    skyline.insert(begin(skyline) + best, {x, best_top, w});
+    for (std::size_t i = 0; i + 1 < skyline.size();)
+        if (skyline[i].y == skyline[i + 1].y)
+        {
+            skyline[i].width += skyline[i + 1].width;
+            skyline.erase(begin(skyline) + i + 1);
+        }
+        else
+            ++i;
+    return true;
+}
+
+std::vector<std::pair<unsigned, unsigned>> pack_rects(std::vector<PackedRect>& rects, unsigned max_size)
+{
+    std::vector<std::size_t> remaining(rects.size()), unplaced;
+    std::iota(begin(remaining), end(remaining), 0);
+    std::stable_sort(begin(remaining), end(remaining), [&](std::size_t a, std::size_t b)
+    {
+        return std::tie(rects[a].height, rects[a].width) > std::tie(rects[b].height, rects[b].width);
+    });
+    std::vector<std::pair<unsigned, unsigned>> pages;
+    while (!remaining.empty())
+    {
+        std::uint64_t area = 0;
+        unsigned widest = 1, tallest = 1;
+        for (auto i : remaining)
+        {
+            area += std::uint64_t(rects[i].width) * rects[i].height;
+            widest = std::max(widest, rects[i].width);
+            tallest = std::max(tallest, rects[i].height);
+        }
+        unsigned width = 1, height = 1;
+        while (width < max_size && (width < widest || std::uint64_t(width) * width < area))
+            width = std::min(width * 2, max_size);
+        while (height < max_size && (height < tallest || std::uint64_t(width) * height < area))
+            height = std::min(height * 2, max_size);
+        for (;;)
+        {
+            SkylinePacker packer(width, height);
+            unplaced.clear();
+            for (auto i : remaining)
+                if (packer.insert(rects[i].width, rects[i].height, rects[i].x, rects[i].y))
+                    rects[i].page = pages.size();
+                else
+                    unplaced.push_back(i);
+            if (unplaced.empty() || (width == max_size && height == max_size))
+                break;
+            if (height < width || width == max_size)
+                height = std::min(height * 2, max_size);
+            else
+                width = std::min(width * 2, max_size);
+        }
+        pages.emplace_back(width, height);
+        remaining.swap(unplaced);
+    }
+    return pages;
+}
+
+namespace
+{
+
+FT_Pos floor_div(FT_Pos a, FT_Pos b)
+{
+    return a / b - (a % b < 0);
+}
+
+void render_oversampled(FT_Face face, std::uint32_t code, unsigned precision, RenderedChar& rc)
+{
+    FT_Load_Char(face, code, FT_LOAD_RENDER);
+    rc.metrics.bearing_x = face->glyph->metrics.horiBearingX / 64;
+    auto bearing_y = face->glyph->metrics.horiBearingY / 64;
+    rc.metrics.bearing_y = (bearing_y + precision - 1) / precision * precision;
+    rc.metrics.advance_x = face->glyph->metrics.horiAdvance / 64;
+    rc.bearing_y = bearing_y;
+    rc.variants.reserve(precision);
+    auto sums = sum_columns(face->glyph->bitmap, precision, (precision - (bearing_y % precision)) % precision);
+    for (unsigned offset = 0; offset < precision; ++offset)
+        rc.variants.push_back(downscale(sums, offset));
+}
+
+// Renders the unhinted outline once per variant, moved right by offset / precision pixels.
+// The outline is placed so that every variant's image starts at the glyph's bearing plus padding.
+void render_outline(FT_Face face, std::uint32_t code, unsigned precision, unsigned variants, unsigned padding, RenderedChar& rc)
+{
+    FT_Load_Char(face, code, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP);
+    auto slot = face->glyph;
+    FT_Pos p = precision;
+    rc.metrics.advance_x = slot->metrics.horiAdvance * p / 64;
+    rc.bearing_y = slot->metrics.horiBearingY * p / 64;
+    rc.variants.resize(variants);
+    if (slot->format != FT_GLYPH_FORMAT_OUTLINE || slot->outline.n_points == 0)
+        return;
+
+    FT_BBox box;
+    FT_Outline_Get_CBox(&slot->outline, &box);
+    auto bearing_x = floor_div(box.xMin * p, 64);
+    auto top = (box.yMax + 63) / 64;
+    auto bottom = floor_div(box.yMin, 64);
+    rc.metrics.bearing_x = bearing_x;
+    rc.metrics.bearing_y = top * p;
+
+    FT_Pos moved_x = 0;
+    FT_Pos pad = padding;
+    FT_Outline_Translate(&slot->outline, pad * 64, (pad - bottom) * 64);
+    for (unsigned offset = 0; offset < variants; ++offset)
+    {
+        auto dx = floor_div((FT_Pos(offset) - bearing_x) * 64, p);
+        FT_Outline_Translate(&slot->outline, dx - moved_x, 0);
+        moved_x = dx;
+        auto& g = rc.variants[offset];
+        g = FontImage(unsigned((box.xMax + dx + 63) / 64 + 2 * pad), unsigned(top - bottom + 2 * pad));
+        FT_Bitmap bitmap;
+        FT_Bitmap_Init(&bitmap);
+        bitmap.rows = g.height;
+        bitmap.width = g.width;
+        bitmap.pitch = g.width;
+        bitmap.buffer = g.alpha.data();
+        bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+        bitmap.num_grays = 256;
+        FT_Outline_Get_Bitmap(slot->library, &slot->outline, &bitmap);
+    }
+}
+
+void render_char(FT_Face face, std::uint32_t code, unsigned precision, int mode, RenderedChar& rc)
+{
+    if (mode == FONT_MODE_OUTLINE)
+        render_outline(face, code, precision, precision, 0, rc);
+    else if (mode == FONT_MODE_LINEAR)
+        render_outline(face, code, precision, 1, LINEAR_PADDING, rc);
+    else
+        render_oversampled(face, code, precision, rc);
+}
+
+// scales font units at the faces' size to 1/precision pixels
+FT_Pos metric_scale(unsigned precision, int mode)
+{
+    return precision / font_oversampling(mode, precision);
+}
+
+// scales 26.6 pixels at the faces' size to 1/precision pixels
+int kerning_value(FT_Pos x, FT_Pos scale)
+{
+    return (x * scale + 31) / 64;
+}
+
+int kerning_value(FT_Face face, FT_UInt left, FT_UInt right, FT_Pos scale)
+{
+    FT_Vector k{};
+    FT_Get_Kerning(face, left, right, FT_KERNING_UNFITTED, &k);
+    return kerning_value(k.x, scale);
+}
+
+}
+
+RasterizedFont rasterize_font(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars, unsigned precision, unsigned max_page_size, int mode)
+{
+    auto face = faces.front();
+    std::vector<RenderedChar> rendered(chars.size());
+    parallel_for(chars.size(), faces.size(), [&](unsigned worker, std::size_t i)
+    {
+        render_char(faces[worker], chars[i], precision, mode, rendered[i]);
+    });
+
+    RasterizedFont font;
+    font.glyphs = GlyphTable(precision);
+    int capital_ascender = 0;
+    std::vector<PackedRect> rects;
+    bool too_big = false;
+    for (std::size_t i = 0; i < chars.size(); ++i)
+        for (auto& g : rendered[i].variants)
+        {
+            too_big = too_big || g.width > max_page_size || g.height > max_page_size;
+            rects.push_back({std::min(g.width, max_page_size), std::min(g.height, max_page_size)});
+        }
+    for (auto& page : pack_rects(rects, max_page_size))
+        font.pages.emplace_back(page.first, page.second);
+
+    auto rect = begin(rects);
+    for (std::size_t i = 0; i < chars.size(); ++i)
+    {
+        auto index = font.glyphs.add_char(chars[i], rendered[i].metrics);
+
+        if (chars[i] == 'T')
+            capital_ascender = rendered[i].bearing_y;
+
+        for (unsigned offset = 0; offset < rendered[i].variants.size(); ++offset, ++rect)
+        {
+            blit(font.pages[rect->page], rect->x, rect->y, rendered[i].variants[offset]);
+            auto& fg = font.glyphs.glyph(index, offset);
+            fg.set_image(rect->x, rect->y, rect->width, rect->height);
+            fg.page = rect->page;
+        }
+        if (mode == FONT_MODE_LINEAR)
+            share_linear_image(font.glyphs, index);
+        rendered[i].variants.clear();
+        rendered[i].variants.shrink_to_fit();
+    }
+
+    auto scale = metric_scale(precision, mode);
+    for (auto& pair : kerning_pairs(faces, chars))
+        if (auto k = kerning_value(pair.x, scale))
+            font.glyphs.set_kerning(pair.left, pair.right, k);
+    auto fallback = font.glyphs.find('?');
+    font.glyphs.fallback = fallback == GlyphTable::NONE ? 0 : fallback;
+
+    if (too_big)
+        std::cerr << "error: font too big" << std::endl;
+
+    auto ascender = capital_ascender ?
+        capital_ascender * 64 :
+        FT_MulFix(face->ascender, face->size->metrics.y_scale) * scale;
+    auto descender = FT_MulFix(-face->descender, face->size->metrics.y_scale) * scale;
+    int p = precision;
+    auto& m = font.metrics;
+    m.precision = precision;
+    m.ascender = (ascender + (32 * p - 1)) / (64 * p);
+    m.descender = -(descender + (32 * p - 1)) / (64 * p);
+    m.height = m.ascender - m.descender;
+    m.center = (ascender - descender + (64 * p - 1)) / (2 * 64 * p);
+    m.baseline_center = (ascender + (64 * p - 1)) / (2 * 64 * p);
+    return font;
+}
+
+double atlas_fill(const RasterizedFont& font)
+{
+    std::uint64_t page_area = 0, used = 0;
+    for (auto& page : font.pages)
+        page_area += std::uint64_t(page.width) * page.height;
+    // FONT_MODE_LINEAR variants share their image
+    const FontGlyph *prev = nullptr;
+    for (auto& g : font.glyphs.glyphs)
+    {
+        if (!prev || std::tie(g.page, g.img_x, g.img_y) != std::tie(prev->page, prev->img_x, prev->img_y))
+            used += std::uint64_t(g.img_width) * g.img_height;
+        prev = &g;
+    }
+    return page_area ? double(used) / page_area : 0;
+}
+
+namespace
+{
+
+constexpr double EDT_INF = 1e20;
+
+// squared distances to the nearest zero sample of f (Felzenszwalb and Huttenlocher),
+// f holds 0 or EDT_INF and is overwritten
+void distance_transform(double *f, unsigned n, std::vector<int>& v, std::vector<double>& z, std::vector<double>& d)
+{
+    v.resize(n);
+    z.resize(n + 1);
+    d.resize(n);
+    int k = 0;
+    v[0] = 0;
+    z[0] = -EDT_INF;
+    z[1] = EDT_INF;
+    for (int q = 1; q < int(n); ++q)
+    {
+        double s;
+        for (;; --k)
+        {
+            auto r = v[k];
+            s = ((f[q] + double(q) * q) - (f[r] + double(r) * r)) / (2 * q - 2 * r);
+            if (s > z[k])
+                break;
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = EDT_INF;
+    }
+    k = 0;
+    for (int q = 0; q < int(n); ++q)
+    {
+        while (z[k + 1] < q)
+            ++k;
+        auto r = v[k];
+        d[q] = double(q - r) * (q - r) + f[r];
+    }
+    std::copy(begin(d), end(d), f);
+}
+
+void distance_transform(std::vector<double>& grid, unsigned width, unsigned height)
+{
+    std::vector<int> v;
+    std::vector<double> z, d, column(height);
+    for (unsigned x = 0; x < width; ++x)
+    {
+        for (unsigned y = 0; y < height; ++y)
+            column[y] = grid[x + y * width];
+        distance_transform(column.data(), height, v, z, d);
+        for (unsigned y = 0; y < height; ++y)
+            grid[x + y * width] = column[y];
+    }
+    for (unsigned y = 0; y < height; ++y)
+        distance_transform(grid.data() + std::size_t(y) * width, width, v, z, d);
+}
+
+}
+
+FontImage signed_distance_field(FT_Bitmap bitmap, int left, int top, unsigned oversample, unsigned spread, int& image_left, int& image_top)
+{
+    image_left = image_top = 0;
+    if (bitmap.width == 0 || bitmap.rows == 0)
+        return {};
+    int os = oversample;
+    image_left = floor_div(left, os) - int(spread);
+    image_top = -floor_div(-top, os) + int(spread);
+    auto x_offset = left - image_left * os;
+    auto y_offset = image_top * os - top;
+    auto pad = int(spread) * os;
+    FontImage sdf{unsigned(x_offset + int(bitmap.width) + pad + os - 1) / os, unsigned(y_offset + int(bitmap.rows) + pad + os - 1) / os};
+
+    auto width = sdf.width * os, height = sdf.height * os;
+    std::vector<double> to_inside(std::size_t(width) * height, EDT_INF), to_outside(std::size_t(width) * height, 0);
+    for (unsigned y = 0; y < bitmap.rows; ++y)
+        for (unsigned x = 0; x < bitmap.width; ++x)
+            if (bitmap.buffer[x + y * bitmap.pitch] >= 128)
+            {
+                auto i = x + x_offset + (y + y_offset) * width;
+                to_inside[i] = 0;
+                to_outside[i] = EDT_INF;
+            }
+    distance_transform(to_inside, width, height);
+    distance_transform(to_outside, width, height);
+
+    for (unsigned gy = 0; gy < sdf.height; ++gy)
+        for (unsigned gx = 0; gx < sdf.width; ++gx)
+        {
+            double sum = 0;
+            for (unsigned y = gy * os; y < (gy + 1) * os; ++y)
+                for (unsigned x = gx * os; x < (gx + 1) * os; ++x)
+                    sum += std::sqrt(to_outside[x + y * width]) - std::sqrt(to_inside[x + y * width]);
+            auto distance = sum / (os * os * os);
+            sdf.alpha[gx + gy * sdf.width] = std::uint8_t(std::min(std::max(std::lround(128 + distance * 127 / spread), 0l), 255l));
+        }
+    return sdf;
+}
+
+SdfFont rasterize_sdf_font(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars, unsigned image_width)
+{
+    const float scale = 64.0f * SDF_OVERSAMPLE;
+    SdfFont font;
+    font.codes = chars;
+    font.chars.resize(chars.size());
+    std::vector<FontImage> images(chars.size());
+    parallel_for(chars.size(), faces.size(), [&](unsigned worker, std::size_t i)
+    {
+        auto slot = faces[worker]->glyph;
+        FT_Load_Char(faces[worker], chars[i], FT_LOAD_RENDER | FT_LOAD_NO_HINTING);
+        int left{}, top{};
+        images[i] = signed_distance_field(slot->bitmap, slot->bitmap_left, slot->bitmap_top, SDF_OVERSAMPLE, SDF_SPREAD, left, top);
+        auto& c = font.chars[i];
+        c.advance = slot->metrics.horiAdvance / scale;
+        c.left = left;
+        c.top = top;
+        if (chars[i] == 'T')
+            font.capital_ascender = slot->metrics.horiBearingY / scale;
+    });
+
+    unsigned dx = 0, dy = 0, row_height = 0;
+    for (std::size_t i = 0; i < chars.size(); ++i)
+    {
+        auto& g = images[i];
+        if (dx + g.width > image_width)
+        {
+            dx = 0;
+            dy += row_height;
+            row_height = 0;
+        }
+        auto& c = font.chars[i];
+        c.img_x = dx;
+        c.img_y = dy;
+        c.img_width = g.width;
+        c.img_height = g.height;
+        row_height = std::max(row_height, g.height);
+        dx += g.width;
+    }
+    unsigned image_height = 1;
+    while (image_height < dy + row_height)
+        image_height *= 2;
+    font.image = FontImage(image_width, image_height);
+    for (std::size_t i = 0; i < chars.size(); ++i)
+        blit(font.image, font.chars[i].img_x, font.chars[i].img_y, images[i]);
+
+    auto face = faces.front();
+    for (auto& pair : kerning_pairs(faces, chars))
+        font.kerning.emplace(GlyphTable::kerning_pair(pair.left, pair.right), pair.x / scale);
+    font.ascender = FT_MulFix(face->ascender, face->size->metrics.y_scale) / scale;
+    font.descender = FT_MulFix(-face->descender, face->size->metrics.y_scale) / scale;
+    return font;
+}
+
+FontMetrics sdf_font_metrics(const SdfFont& font, float scale, unsigned precision)
+{
+    auto ascender = (font.capital_ascender ? font.capital_ascender : font.ascender) * scale;
+    auto descender = font.descender * scale;
+    FontMetrics m;
+    m.precision = precision;
+    m.ascender = int(std::lround(ascender));
+    m.descender = -int(std::lround(descender));
+    m.height = m.ascender - m.descender;
+    m.center = int(std::ceil((ascender - descender) / 2));
+    m.baseline_center = int(std::ceil(ascender / 2));
+    return m;
+}
+
+// Every variant shares the same image and only moves its quad by a fraction of a pixel.
+GlyphTable sdf_glyph_table(const SdfFont& font, float scale, unsigned precision)
+{
+    GlyphTable table(precision);
+    float p = precision;
+    for (std::size_t i = 0; i < font.chars.size(); ++i)
+    {
+        auto& c = font.chars[i];
+        auto top = c.top * scale;
+        FontChar ch;
+        ch.bearing_x = int(std::lround(c.left * scale * p));
+        ch.bearing_y = int(std::ceil(top)) * int(precision);
+        ch.advance_x = int(std::lround(c.advance * scale * p));
+        auto index = table.add_char(font.codes[i], ch);
+        for (unsigned v = 0; v < precision; ++v)
+        {
+            auto& g = table.glyph(index, v);
+            g.img_x = c.img_x;
+            g.img_y = c.img_y;
+            g.img_width = c.img_width;
+            g.img_height = c.img_height;
+            g.x0 = v / p;
+            g.x1 = g.x0 + c.img_width * scale;
+            g.y1 = top - std::ceil(top);
+            g.y0 = g.y1 - c.img_height * scale;
+        }
+    }
+    for (auto& pair : font.kerning)
+        if (auto k = int(std::lround(pair.second * scale * p)))
+            table.set_kerning(pair.first >> 16, pair.first & 0xffff, k);
+    auto fallback = table.find('?');
+    table.fallback = fallback == GlyphTable::NONE ? 0 : fallback;
+    return table;
+}
+
+std::vector<FontImage> render_char(FT_Face face, std::uint32_t code, unsigned precision, int mode, FontChar& metrics)
+{
+    RenderedChar rc;
+    render_char(face, code, precision, mode, rc);
+    metrics = rc.metrics;
+    return std::move(rc.variants);
+}
+
+int char_kerning(FT_Face face, std::uint32_t left, std::uint32_t right, unsigned precision, int mode)
+{
+    return kerning_value(face, FT_Get_Char_Index(face, left), FT_Get_Char_Index(face, right), metric_scale(precision, mode));
+}
+
+bool read_kern_table(FT_Face face, const std::vector<std::uint32_t>& chars, std::vector<KerningPair>& pairs)
+{
+    FT_ULong length = 0;
+    if (!FT_IS_SFNT(face) || FT_Load_Sfnt_Table(face, TTAG_kern, 0, nullptr, &length) != 0 || length < 4)
+        return false;
+    std::vector<FT_Byte> table(length);
+    if (FT_Load_Sfnt_Table(face, TTAG_kern, 0, table.data(), &length) != 0)
+        return false;
+    auto u16 = [&](std::size_t at) { return unsigned(table[at] << 8 | table[at + 1]); };
+    // Apple's version 1 tables are ignored by FreeType as well
+    if (u16(0) != 0)
+        return false;
+
+    // the chars of each glyph, missing chars share glyph 0
+    std::unordered_map<FT_UInt, std::vector<std::uint16_t>> glyph_chars;
+    for (std::size_t i = 0; i < chars.size(); ++i)
+        glyph_chars[FT_Get_Char_Index(face, chars[i])].push_back(std::uint16_t(i));
+
+    // sums the horizontal subtables, an override subtable replaces the sum for the pairs it lists
+    std::unordered_map<std::uint32_t, FT_Pos> values;
+    std::size_t at = 4;
+    for (auto count = u16(2); count > 0 && at + 6 <= length; --count)
+    {
+        auto next = std::min<std::size_t>(at + u16(at + 2), length);
+        auto coverage = u16(at + 4);
+        // format 0, horizontal, neither minimum nor cross-stream values
+        if ((coverage & ~8u) != 1 || at + 14 > next)
+        {
+            at = std::max(next, at + 6);
+            continue;
+        }
+        auto override_sum = (coverage & 8) != 0;
+        auto pair_count = std::min<std::size_t>(u16(at + 6), (next - at - 14) / 6);
+        std::unordered_map<std::uint32_t, FT_Pos> subtable;
+        for (std::size_t i = 0; i < pair_count; ++i)
+        {
+            auto p = at + 14 + i * 6;
+            auto left = u16(p), right = u16(p + 2);
+            if (glyph_chars.count(left) && glyph_chars.count(right))
+                subtable.emplace(std::uint32_t(left) << 16 | right, std::int16_t(u16(p + 4)));
+        }
+        for (auto& value : subtable)
+            if (override_sum)
+                values[value.first] = value.second;
+            else
+                values[value.first] += value.second;
+        at = next;
+    }
+
+    auto x_scale = face->size->metrics.x_scale;
+    for (auto& value : values)
+    {
+        auto x = FT_MulFix(value.second, x_scale);
+        if (x == 0)
+            continue;
+        for (auto left : glyph_chars[value.first >> 16])
+            for (auto right : glyph_chars[value.first & 0xffff])
+                pairs.push_back({left, right, x});
+    }
+    std::sort(begin(pairs), end(pairs), [](const KerningPair& a, const KerningPair& b)
+    {
+        return std::tie(a.left, a.right) < std::tie(b.left, b.right);
+    });
+    return true;
+}
+
+std::vector<KerningPair> kerning_pairs(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars)
+{
+    std::vector<KerningPair> pairs;
+    auto face = faces.front();
+    if (!FT_HAS_KERNING(face) || read_kern_table(face, chars, pairs))
+        return pairs;
+
+    auto n = chars.size();
+    std::vector<FT_UInt> ft_indices;
+    for (auto c : chars)
+        ft_indices.push_back(FT_Get_Char_Index(face, c));
+    std::vector<std::vector<KerningPair>> rows(n);
+    parallel_for(n, faces.size(), [&](unsigned worker, std::size_t a)
+    {
+        for (std::size_t b = 0; b < n; ++b)
+        {
+            FT_Vector k{};
+            FT_Get_Kerning(faces[worker], ft_indices[a], ft_indices[b], FT_KERNING_UNFITTED, &k);
+            if (k.x != 0)
+                rows[a].push_back({std::uint16_t(a), std::uint16_t(b), k.x});
+        }
+    });
+    for (auto& row : rows)
+        pairs.insert(end(pairs), begin(row), end(row));
+    return pairs;
+}
+
+void share_linear_image(GlyphTable& table, std::uint16_t index)
+{
+    auto& first = table.glyph(index, 0);
+    float p = table.precision;
+    for (unsigned v = 0; v < table.precision; ++v)
+    {
+        auto& g = table.glyph(index, v);
+        g = first;
+        g.x0 = v / p - LINEAR_PADDING;
+        g.x1 = g.x0 + g.img_width;
+        g.y1 = LINEAR_PADDING;
+        g.y0 = g.y1 - g.img_height;
+    }
+}
+
+std::string font_cache_dir()
+{
+    if (auto dir = std::getenv("HCC_CACHE_DIR"))
+        return dir;
+    if (auto dir = std::getenv("XDG_CACHE_HOME"))
+        return std::string(dir) + "/hcc";
+    if (auto dir = std::getenv("HOME"))
+        return std::string(dir) + "/.cache/hcc";
+    return {};
+}
+
+std::uint64_t font_cache_key(const char *font_path, unsigned size, unsigned scale, unsigned precision, int mode, const std::vector<std::uint32_t>& chars)
+{
+    return font_cache_key(FontFile(font_path), size, scale, precision, mode, chars);
+}
+
+std::uint64_t font_cache_key(const FontFile& file, unsigned size, unsigned scale, unsigned precision, int mode, const std::vector<std::uint32_t>& chars)
+{
+    if (!file.file.data)
+        return 0;
+    std::array<std::uint32_t, 5> params{{FONT_CACHE_VERSION, size, scale, precision, std::uint32_t(mode)}};
+    auto key = hash_bytes(params.data(), sizeof(params), file.hash);
+    return hash_bytes(chars.data(), sizeof(chars[0]) * chars.size(), key);
+}
+
+std::string font_cache_path(const std::string& dir, std::uint64_t key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/font-%016llx.bin", static_cast<unsigned long long>(key));
+    return dir + name;
+}
+
+bool save_font_cache(const std::string& path, std::uint64_t key, const RasterizedFont& font)
+{
+    auto& table = font.glyphs;
+    std::vector<FontCacheChar> chars(table.chars.size());
+    for (std::size_t i = 0; i < chars.size(); ++i)
+        chars[i] = {0, table.chars[i].bearing_x, table.chars[i].bearing_y, table.chars[i].advance_x};
+    for (std::uint32_t code = 0; code < table.latin1.size(); ++code)
+        if (table.latin1[code] != GlyphTable::NONE)
+            chars[table.latin1[code]].code = code;
+    for (auto& other : table.others)
+        chars[other.second].code = other.first;
+    std::vector<FontCacheGlyph> glyphs;
+    glyphs.reserve(table.glyphs.size());
+    for (auto& g : table.glyphs)
+        glyphs.push_back({g.img_x, g.img_y, g.img_width, g.img_height, g.page});
+    std::vector<FontCacheKerning> kerning;
+    for (auto& pair : table.sparse_kerning)
+        if (pair.second != 0)
+            kerning.push_back({pair.first, pair.second});
+    std::sort(begin(kerning), end(kerning), [](const FontCacheKerning& a, const FontCacheKerning& b) { return a.pair < b.pair; });
+    std::vector<FontCachePage> pages;
+    for (auto& page : font.pages)
+        pages.push_back({page.width, page.height});
+
+    auto& m = font.metrics;
+    FontCacheHeader header{
+        {'H', 'C', 'C', 'F'}, FONT_CACHE_VERSION, key,
+        m.precision, m.ascender, m.descender, m.height, m.center, m.baseline_center,
+        std::uint32_t(chars.size()), std::uint32_t(pages.size()), std::uint32_t(kerning.size())};
+
+    auto dir = path.substr(0, path.rfind('/'));
+    make_dirs(dir);
+    auto tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        write_values(out, &header, 1);
+        write_values(out, pages.data(), pages.size());
+        write_values(out, chars.data(), chars.size());
+        write_values(out, glyphs.data(), glyphs.size());
+        write_values(out, kerning.data(), kerning.size());
+        for (auto& page : font.pages)
+            write_values(out, page.alpha.data(), std::size_t(page.width) * page.height);
+        if (!out)
+        {
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool load_font_cache(const MappedFile& file, std::uint64_t key, RasterizedFont& font, std::vector<const std::uint8_t *>& alpha)
+{
+    if (!file.data)
+        return false;
+    auto p = file.data, end = file.data + file.size;
+    FontCacheHeader header;
+    if (!read_values(p, end, &header, 1) ||
+        std::memcmp(header.magic, "HCCF", 4) != 0 ||
+        header.version != FONT_CACHE_VERSION ||
+        header.key != key ||
+        header.precision <= 0)
+        return false;
+
+    std::vector<FontCachePage> pages;
+    std::vector<FontCacheChar> chars;
+    std::vector<FontCacheGlyph> glyphs;
+    std::vector<FontCacheKerning> kerning;
+    if (!read_vector(p, end, pages, header.page_count) ||
+        !read_vector(p, end, chars, header.char_count) ||
+        !read_vector(p, end, glyphs, std::size_t(header.char_count) * std::uint32_t(header.precision)) ||
+        !read_vector(p, end, kerning, header.kerning_count))
+        return false;
+    std::size_t image_size = 0;
+    for (auto& page : pages)
+    {
+        auto size = std::size_t(page.width) * page.height;
+        if (size > std::size_t(end - p) - image_size)
+            return false;
+        image_size += size;
+    }
+    // glyphs have to stay on their page, anything else is a corrupt file
+    for (auto& g : glyphs)
+        if (g.page < 0 || std::uint32_t(g.page) >= header.page_count ||
+            g.img_x < 0 || g.img_y < 0 || g.img_width < 0 || g.img_height < 0 ||
+            std::uint32_t(g.img_x) + std::uint32_t(g.img_width) > pages[g.page].width ||
+            std::uint32_t(g.img_y) + std::uint32_t(g.img_height) > pages[g.page].height)
+            return false;
+    for (auto& pair : kerning)
+        if ((pair.pair >> 16) >= header.char_count || (pair.pair & 0xffff) >= header.char_count)
+            return false;
+
+    font.glyphs = GlyphTable(header.precision);
+
+    for (auto& ch : chars)
+        font.glyphs.add_char(ch.code, {ch.bearing_x, ch.bearing_y, ch.advance_x});
+    for (std::size_t i = 0; i < glyphs.size(); ++i)
+    {
+        auto& g = font.glyphs.glyphs[i];
+        g.set_image(glyphs[i].img_x, glyphs[i].img_y, glyphs[i].img_width, glyphs[i].img_height);
+        g.page = glyphs[i].page;
+    }
+    for (auto& pair : kerning)
+        font.glyphs.set_kerning(pair.pair >> 16, pair.pair & 0xffff, pair.value);
+    auto fallback = font.glyphs.find('?');
+    font.glyphs.fallback = fallback == GlyphTable::NONE ? 0 : fallback;
+
+    auto& m = font.metrics;
+    m.precision = header.precision;
+    m.ascender = header.ascender;
+    m.descender = header.descender;
+    m.height = header.height;
+    m.center = header.center;
+    m.baseline_center = header.baseline_center;
+    font.pages.clear();
+    alpha.clear();
+    for (auto& page : pages)
+    {
+        font.pages.emplace_back();
+        font.pages.back().width = page.width;
+        font.pages.back().height = page.height;
+        alpha.push_back(p);
+        p += std::size_t(page.width) * page.height;
+    }
+    return true;
+}
+
+std::pair<std::uint32_t, std::int64_t> decode_utf8_char(const char *p)
+{
+    const std::pair<std::uint32_t, std::int64_t> ERROR{0xffffffff, 1};
+    if ((*p & 0x80) == 0)
+        return {*p, 1};
+    if ((*p & 0x40) == 0 || (p[1] & 0x80) == 0)
+        return ERROR;
+    if ((*p & 0x20) == 0)
+        return {(p[1] & std::uint32_t(0x3f)) | ((p[0] & std::uint32_t(0x1f)) << 6), 2};
+    if ((p[2] & 0x80) == 0)
+        return ERROR;
+    if ((*p & 0x10) == 0)
+        return {(p[2] & std::uint32_t(0x3f)) | ((p[1] & std::uint32_t(0x3f)) << 6) | ((p[0] & std::uint32_t(0xf)) << 12), 3};
+    if ((*p & 8) == 1 || (p[3] & 0x80) == 0)
+        return ERROR;
+    return {(p[3] & std::uint32_t(0x3f)) | ((p[2] & std::uint32_t(0x3f)) << 6) | ((p[1] & std::uint32_t(0x3f)) << 12) | ((p[0] & std::uint32_t(7)) << 18), 4};
+}
+
+TextLine fit_text_line(const GlyphTable& glyphs, std::int64_t max_width, const char *text)
+{
+    std::int64_t width = 0;
+    TextLine last_break;
+    std::int64_t ws_count = 0;
+    auto prev = GlyphTable::NONE;
+    auto p = text;
+    while (*p && *p != '\n')
+    {
+        auto ch = decode_utf8_char(p);
+        if (ch.first >= CC_FIRST && ch.first <= CC_LAST)
+        {
+            p += ch.second;
+            continue;
+        }
+        auto index = glyphs.index(ch.first);
+        if (ch.first == ' ')
+            last_break = {width, p, ws_count};
+        auto new_width = width;
+        if (prev != GlyphTable::NONE)
+            new_width += glyphs.kern(prev, index);
+        new_width += glyphs.chars[index].advance_x;
+        if (new_width > max_width && width > 0)
+            return last_break.end ? last_break : TextLine{width, p, ws_count};
+
+        if (ch.first == ' ')
+            ++ws_count;
+        width = new_width;
+        prev = index;
+        p += ch.second;
+    }
+    return {width, p, ws_count};
+}
+
+std::int64_t newline_count(const GlyphTable& glyphs, std::int64_t max_width, const char *text)
+{
+    std::int64_t n = 0;
+    auto line = fit_text_line(glyphs, max_width, text);
+    while (*line.end)
+    {
+        ++n;
+        if (*line.end == '\n' || *line.end == ' ')
+            ++line.end;
+        line = fit_text_line(glyphs, max_width, line.end);
+    }
+    return n;
+}
+
+void break_lines(const GlyphTable& glyphs, std::int64_t max_width, const char *text, std::vector<TextLine>& lines)
+{
+    lines.clear();
+    lines.push_back(fit_text_line(glyphs, max_width, text));
+    while (*lines.back().end)
+    {
+        auto next = lines.back().end;
+        if (*next == '\n' || *next == ' ')
+            ++next;
+        lines.push_back(fit_text_line(glyphs, max_width, next));
+    }
+}
+
+}
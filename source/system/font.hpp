@@ -0,0 +1,425 @@
+#pragma once
+#include <cstdint>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_SIZES_H
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hcc
+{
+
+constexpr int VA_BOTTOM = -1;
+constexpr int VA_BASELINE = 0;
+constexpr int VA_CENTER = 1;
+constexpr int VA_BASELINE_CENTER = 2;
+constexpr int VA_TOP = 3;
+
+constexpr int V_LEFT = 0;
+constexpr int V_CENTER = 1;
+constexpr int V_RIGHT = 2;
+constexpr int V_JUSTIFY = 3;
+
+constexpr int FONT_MODE_OVERSAMPLE = 0;
+constexpr int FONT_MODE_OUTLINE = 1;
+constexpr int FONT_MODE_SDF = 2;
+constexpr int FONT_MODE_LINEAR = 3;
+
+// FONT_MODE_LINEAR renders each char once, padded by LINEAR_PADDING pixels, and moves
+// the quad of each variant by a fraction of a pixel to be sampled bilinearly
+constexpr unsigned LINEAR_PADDING = 1;
+
+// how many times larger than the target size the faces are sized, except for FONT_MODE_SDF
+inline unsigned font_oversampling(int mode, unsigned precision)
+{
+    return mode == FONT_MODE_OVERSAMPLE ? precision : 1;
+}
+
+// how many images are rendered per char
+inline unsigned font_variants(int mode, unsigned precision)
+{
+    return mode == FONT_MODE_LINEAR ? 1 : precision;
+}
+
+// signed distance fields are rendered once per face at SDF_SIZE points,
+// SDF_OVERSAMPLE times larger, and store distances up to SDF_SPREAD pixels
+constexpr unsigned SDF_SIZE = 32;
+constexpr unsigned SDF_OVERSAMPLE = 4;
+constexpr unsigned SDF_SPREAD = 4;
+
+constexpr std::uint32_t CC_FIRST = 0xe000;
+constexpr std::uint32_t CC_SET_ALPHA = 0xe000;
+constexpr std::uint32_t CC_SET_RED = 0xe100;
+constexpr std::uint32_t CC_SET_GREEN = 0xe200;
+constexpr std::uint32_t CC_SET_BLUE = 0xe300;
+constexpr std::uint32_t CC_RESET = 0xe400;
+constexpr std::uint32_t CC_SET_ALIGN = 0xe500;
+constexpr std::uint32_t CC_LAST = 0xefff;
+
+struct FontImage
+{
+    unsigned width{}, height{};
+    std::vector<std::uint8_t> alpha;
+
+    FontImage() = default;
+    FontImage(unsigned width, unsigned height)
+        : width(width), height(height), alpha(width * height, 0) { }
+};
+
+// A glyph rendered for one subpixel pen position; page indexes the font's images,
+// the pages after them hold glyphs rendered on first use. The quad corners
+// are in pixels relative to the glyph position, with y going up.
+struct FontGlyph
+{
+    int img_x{}, img_y{}, img_width{}, img_height{};
+    float s0{}, t0{}, s1{}, t1{};
+    int page{};
+    float x0{}, y0{}, x1{}, y1{};
+
+    // an image drawn pixel for pixel below the glyph position
+    void set_image(int x, int y, int width, int height)
+    {
+        img_x = x;
+        img_y = y;
+        img_width = width;
+        img_height = height;
+        x0 = 0;
+        y0 = -height;
+        x1 = width;
+        y1 = 0;
+    }
+};
+
+struct FontChar
+{
+    int bearing_x{}, bearing_y{}, advance_x{};
+};
+
+// Characters are identified by a compact index. Latin-1 characters are
+// found with a direct lookup, the rest with a binary search.
+// Chars added with add_char come first, the ones added later follow them.
+// Kerning is kept per pair: the nonzero pairs of the preloaded chars, and
+// the pairs looked up so far for chars added later.
+struct GlyphTable
+{
+    static constexpr std::uint16_t NONE = 0xffff;
+
+    unsigned precision{};
+    std::vector<FontChar> chars;
+    std::vector<FontGlyph> glyphs;
+    std::uint16_t dense_chars{};
+    std::unordered_map<std::uint32_t, int> sparse_kerning;
+    // the chars on the left of a nonzero pair in sparse_kerning, the others skip the lookup
+    std::vector<bool> kerns_left;
+    std::vector<std::uint16_t> free_chars;
+    std::array<std::uint16_t, 256> latin1;
+    std::vector<std::pair<std::uint32_t, std::uint16_t>> others;
+    std::uint16_t fallback{};
+
+    GlyphTable() { latin1.fill(NONE); }
+    explicit GlyphTable(unsigned precision) : precision(precision) { latin1.fill(NONE); }
+
+    std::uint16_t add_char(std::uint32_t code, const FontChar& ch);
+    // reuses the index of a removed char if there is one
+    std::uint16_t add_sparse_char(std::uint32_t code, const FontChar& ch);
+    void remove_sparse_char(std::uint32_t code);
+    std::uint16_t find(std::uint32_t code) const;
+
+    std::uint16_t index(std::uint32_t code) const
+    {
+        auto i = find(code);
+        return i == NONE ? fallback : i;
+    }
+
+    static std::uint32_t kerning_pair(std::uint16_t left, std::uint16_t right)
+    {
+        return std::uint32_t(left) << 16 | right;
+    }
+
+    void set_kerning(std::uint16_t left, std::uint16_t right, int value)
+    {
+        sparse_kerning[kerning_pair(left, right)] = value;
+        if (value == 0)
+            return;
+        if (kerns_left.size() <= left)
+            kerns_left.resize(left + 1);
+        kerns_left[left] = true;
+    }
+
+    int kern(std::uint16_t left, std::uint16_t right) const
+    {
+        if (left >= kerns_left.size() || !kerns_left[left])
+            return 0;
+        auto found = sparse_kerning.find(kerning_pair(left, right));
+        return found == sparse_kerning.end() ? 0 : found->second;
+    }
+
+    FontGlyph& glyph(std::uint16_t index, unsigned variant)
+    {
+        return glyphs[index * precision + variant];
+    }
+
+    const FontGlyph& glyph(std::uint16_t index, unsigned variant) const
+    {
+        return glyphs[index * precision + variant];
+    }
+};
+
+struct FontMetrics
+{
+    int precision{};
+    int ascender{}, descender{}, height{}, center{}, baseline_center{};
+};
+
+struct RasterizedFont
+{
+    FontMetrics metrics;
+    std::vector<FontImage> pages;
+    GlyphTable glyphs;
+};
+
+// bottom-left skyline bin packing
+struct SkylinePacker
+{
+    struct Node
+    {
+        unsigned x{}, y{}, width{};
+    };
+
+    unsigned width{}, height{};
+    std::vector<Node> skyline;
+
+    SkylinePacker(unsigned width, unsigned height) : width(width), height(height), skyline{{0, 0, width}} { }
+
+    // places the rectangle where its top ends lowest
+    bool insert(unsigned w, unsigned h, unsigned& x, unsigned& y);
+};
+
+struct PackedRect
+{
+    unsigned width{}, height{};
+    unsigned x{}, y{}, page{};
+};
+
+// a char of an SdfFont in pixels at SDF_SIZE, the image box with y going up from the baseline
+struct SdfChar
+{
+    float advance{}, left{}, top{};
+    int img_x{}, img_y{}, img_width{}, img_height{};
+};
+
+struct SdfFont
+{
+    std::vector<std::uint32_t> codes;
+    std::vector<SdfChar> chars;
+    // GlyphTable::kerning_pair of char indices
+    std::unordered_map<std::uint32_t, float> kerning;
+    float capital_ascender{}, ascender{}, descender{};
+    FontImage image;
+};
+
+// a read-only memory mapping of a whole file
+struct MappedFile
+{
+    const std::uint8_t *data{};
+    std::size_t size{};
+
+    MappedFile() = default;
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+};
+
+// A font file mapped once, with faces created from the mapping for the rasterizing threads.
+// Every font size gets its own FT_Size objects, activate them before using the faces.
+struct FontFile
+{
+    std::string path;
+    MappedFile file;
+    std::uint64_t hash{};
+    std::vector<FT_Face> faces;
+
+    explicit FontFile(const std::string& path);
+    FontFile(const FontFile&) = delete;
+    FontFile& operator=(const FontFile&) = delete;
+    ~FontFile();
+
+    // creates faces up to count
+    bool open_faces(FT_Library freetype, unsigned count);
+    // adds an activated size to the first count faces
+    std::vector<FT_Size> new_sizes(unsigned count);
+};
+
+void done_sizes(const std::vector<FT_Size>& sizes);
+
+// the kerning of two chars of a charset in 26.6 pixels at the face's size
+struct KerningPair
+{
+    std::uint16_t left{}, right{};
+    FT_Pos x{};
+};
+
+struct TextLine
+{
+    std::int64_t width{};
+    const char *end{};
+    std::int64_t ws_count{};
+};
+
+// sums of every n rows of a bitmap shifted down by y_offset rows
+struct ColumnSums
+{
+    unsigned n{}, width{}, height{};
+    std::vector<std::uint16_t> sums;
+};
+
+ColumnSums sum_columns(FT_Bitmap bitmap, unsigned n, unsigned y_offset);
+// box filters the bitmap shifted right by offset pixels, n must not exceed 257
+FontImage downscale(const ColumnSums& sums, unsigned offset);
+FontImage downscale(FT_Bitmap bitmap, unsigned n, unsigned offset, unsigned y_offset);
+void blit(FontImage& dst, unsigned dx, unsigned dy, const FontImage& src);
+// Packs the rectangles tallest first onto pages of the smallest power of two sizes that fit them,
+// up to max_size, and opens another page when a page of max_size is full. Returns the page sizes.
+std::vector<std::pair<unsigned, unsigned>> pack_rects(std::vector<PackedRect>& rects, unsigned max_size);
+// Renders the glyphs on one thread per face; the faces must be opened from the same file at the same size.
+// FONT_MODE_OVERSAMPLE expects faces sized precision times larger, the other modes at the target size.
+RasterizedFont rasterize_font(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars, unsigned precision, unsigned max_page_size, int mode);
+// the share of the pages covered by glyph images
+double atlas_fill(const RasterizedFont& font);
+// renders one char the way rasterize_font does, for chars added to a font later
+std::vector<FontImage> render_char(FT_Face face, std::uint32_t code, unsigned precision, int mode, FontChar& metrics);
+int char_kerning(FT_Face face, std::uint32_t left, std::uint32_t right, unsigned precision, int mode);
+// Reads the nonzero kerning of the chars' pairs from the horizontal format 0 subtables of the
+// face's kern table, the way FT_Get_Kerning does. Returns false if the face has no such table.
+bool read_kern_table(FT_Face face, const std::vector<std::uint32_t>& chars, std::vector<KerningPair>& pairs);
+// the nonzero kerning of the chars' pairs, from the kern table or from FT_Get_Kerning on one thread per face
+std::vector<KerningPair> kerning_pairs(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars);
+// points the variants of a FONT_MODE_LINEAR char at the image of the first one
+void share_linear_image(GlyphTable& table, std::uint16_t index);
+
+// 128 marks the outline, inside is brighter by 127 / SDF_SPREAD per pixel at SDF_SIZE
+FontImage signed_distance_field(FT_Bitmap bitmap, int left, int top, unsigned oversample, unsigned spread, int& image_left, int& image_top);
+// the faces must be sized SDF_SIZE * SDF_OVERSAMPLE points
+SdfFont rasterize_sdf_font(const std::vector<FT_Face>& faces, const std::vector<std::uint32_t>& chars, unsigned image_width);
+// scale is the font size divided by SDF_SIZE
+FontMetrics sdf_font_metrics(const SdfFont& font, float scale, unsigned precision);
+GlyphTable sdf_glyph_table(const SdfFont& font, float scale, unsigned precision);
+
+std::string font_cache_dir();
+std::uint64_t font_cache_key(const FontFile& font_file, unsigned size, unsigned scale, unsigned precision, int mode, const std::vector<std::uint32_t>& chars);
+std::uint64_t font_cache_key(const char *font_path, unsigned size, unsigned scale, unsigned precision, int mode, const std::vector<std::uint32_t>& chars);
+std::string font_cache_path(const std::string& dir, std::uint64_t key);
+bool save_font_cache(const std::string& path, std::uint64_t key, const RasterizedFont& font);
+// fills everything except the pages' alpha and points alpha into the mapping instead, one pointer per page
+bool load_font_cache(const MappedFile& file, std::uint64_t key, RasterizedFont& font, std::vector<const std::uint8_t *>& alpha);
+
+std::pair<std::uint32_t, std::int64_t> decode_utf8_char(const char *p);
+TextLine fit_text_line(const GlyphTable& glyphs, std::int64_t max_width, const char *text);
+std::int64_t newline_count(const GlyphTable& glyphs, std::int64_t max_width, const char *text);
+void break_lines(const GlyphTable& glyphs, std::int64_t max_width, const char *text, std::vector<TextLine>& lines);
+
+// Lays out text in a box with the bottom-left corner at (0, 0) and calls
+// emit(glyph, x, y, color) for every glyph, with x and y in pixels.
+// The lines are measured once into the given buffer.
+template <typename Emit>
+void layout_text(
+    const FontMetrics& font, const GlyphTable& glyphs, std::vector<TextLine>& lines,
+    const char *text,
+    std::int64_t width, std::int64_t height,
+    std::int64_t align, std::int64_t valign,
+    std::int64_t c_r, std::int64_t c_g, std::int64_t c_b, std::int64_t c_a,
+    Emit emit)
+{
+    std::int64_t y = 0;
+    const auto sc_r = c_r, sc_g = c_g, sc_b = c_b, sc_a = c_a, salign = align;
+    auto calc_pen_x = [&](std::int64_t line_width)
+                          {
+                              switch (align)
+                              {
+                              case V_RIGHT: return width * font.precision - line_width;
+                              case V_CENTER: return width / 2 * font.precision - line_width / 2;
+                              default: return std::int64_t(0);
+                              }
+                          };
+    auto run_modifier = [&](std::uint32_t code)
+                            {
+                                switch (code & 0xff00)
+                                {
+                                case CC_SET_ALPHA: c_a = code & 0xff; break;
+                                case CC_SET_RED: c_r = code & 0xff; break;
+                                case CC_SET_GREEN: c_g = code & 0xff; break;
+                                case CC_SET_BLUE: c_b = code & 0xff; break;
+                                case CC_RESET: c_a = sc_a; c_r = sc_r; c_g= sc_g; c_b = sc_b; align = salign; break;
+                                case CC_SET_ALIGN: align = code & 0xff; break;
+                                }
+                            };
+
+    break_lines(glyphs, width * font.precision, text, lines);
+    std::int64_t newlines = lines.size() - 1;
+    switch (valign)
+    {
+    case VA_BOTTOM: y += newlines * font.height  - font.descender; break;
+    case VA_CENTER: y += height / 2 + newlines * font.height / 2 - font.center; break;
+    case VA_BASELINE_CENTER: y += height / 2 + newlines * font.height / 2 - font.baseline_center; break;
+    case VA_TOP: y += height - font.ascender; break;
+    case VA_BASELINE: y += newlines * font.height;
+    default:;
+    }
+
+    for (auto& line : lines)
+    {
+        if (!*text)
+            break;
+        while (text < line.end)
+        {
+            auto ch = decode_utf8_char(text);
+            if (ch.first < CC_FIRST || ch.first > CC_LAST)
+                break;
+            text += ch.second;
+            run_modifier(ch.first);
+        }
+
+        auto pen_x = calc_pen_x(line.width);
+        auto extra_width = width * font.precision - line.width;
+        auto ws_n = 0;
+        auto prev = GlyphTable::NONE;
+        while (text < line.end)
+        {
+            auto ch = decode_utf8_char(text);
+            if (ch.first >= CC_FIRST && ch.first <= CC_LAST)
+            {
+                text += ch.second;
+                run_modifier(ch.first);
+                continue;
+            }
+
+            auto index = glyphs.index(ch.first);
+            if (prev != GlyphTable::NONE)
+                pen_x += glyphs.kern(prev, index);
+
+            auto& char_ = glyphs.chars[index];
+            auto glyph_x = pen_x + char_.bearing_x;
+            auto glyph_x_rem = ((glyph_x % font.precision) + font.precision) % font.precision;
+            std::array<std::uint8_t, 4> color{{std::uint8_t(c_r), std::uint8_t(c_g), std::uint8_t(c_b), std::uint8_t(c_a)}};
+            emit(glyphs.glyph(index, glyph_x_rem), (glyph_x - glyph_x_rem) / font.precision, y + char_.bearing_y / font.precision, color);
+            pen_x += char_.advance_x;
+
+            if (align == V_JUSTIFY && ch.first == ' ' && *line.end == ' ')
+            {
+                pen_x += extra_width * (ws_n + 1) / line.ws_count - extra_width * ws_n / line.ws_count;
+                ++ws_n;
+            }
+            prev = index;
+            text += ch.second;
+        }
+        if (*text == '\n' || *text == ' ')
+            ++text;
+        y -= font.height;
+    }
+}
+
+}
@@ -9,6 +9,11 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_GLYPH_H
+#include "font.hpp"
+#include "asset_pack.hpp"
+#include "atlas.hpp"
+#include "color.hpp"
+#include "parallel.hpp"
 #include <string>
 #include <vector>
 #include <memory>
@@ -17,31 +22,60 @@
 #include <numeric>
 #include <iostream>
 #include <unordered_map>
-#include <png.h>
+#include <list>
+#include <tuple>
 #include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <iterator>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
 
 namespace
 {
 
-constexpr int VA_BOTTOM = -1;
-constexpr int VA_BASELINE = 0;
-constexpr int VA_CENTER = 1;
-constexpr int VA_BASELINE_CENTER = 2;
-constexpr int VA_TOP = 3;
-
-constexpr int V_LEFT = 0;
-constexpr int V_CENTER = 1;
-constexpr int V_RIGHT = 2;
-constexpr int V_JUSTIFY = 3;
-
-constexpr std::uint32_t CC_FIRST = 0xe000;
-constexpr std::uint32_t CC_SET_ALPHA = 0xe000;
-constexpr std::uint32_t CC_SET_RED = 0xe100;
-constexpr std::uint32_t CC_SET_GREEN = 0xe200;
-constexpr std::uint32_t CC_SET_BLUE = 0xe300;
-constexpr std::uint32_t CC_RESET = 0xe400;
-constexpr std::uint32_t CC_SET_ALIGN = 0xe500;
-constexpr std::uint32_t CC_LAST = 0xefff;
+using namespace hcc;
+
+constexpr std::int64_t STAT_UPLOADED_BYTES = 0;
+constexpr std::int64_t STAT_BUFFER_REALLOCATIONS = 1;
+constexpr std::int64_t STAT_DIRTY_PIXELS = 2;
+constexpr std::int64_t STAT_SKIPPED_PASSES = 3;
+constexpr std::int64_t STAT_IMAGE_DRAW_CALLS = 4;
+constexpr std::int64_t STAT_ARC_DRAW_CALLS = 5;
+constexpr std::int64_t STAT_FONT_DRAW_CALLS = 6;
+constexpr std::int64_t STAT_COMBINE_DRAW_CALLS = 7;
+constexpr std::int64_t STAT_TEXT_CACHE_HITS = 8;
+constexpr std::int64_t STAT_TEXT_CACHE_MISSES = 9;
+constexpr std::int64_t STAT_GLYPH_MISSES = 10;
+constexpr std::int64_t STAT_GLYPH_ATLAS_OCCUPANCY = 11;
+constexpr std::int64_t STAT_PENDING_ASSETS = 12;
+constexpr std::int64_t STAT_COUNT = 13;
+
+constexpr std::size_t IMAGE_LAYER = 0;
+constexpr std::size_t ARC_LAYER = 1;
+constexpr std::size_t FONT_LAYER = 2;
+constexpr std::size_t LAYER_COUNT = 3;
+
+constexpr GLsizei MAX_QUADS_PER_DRAW = 65536 / 4;
+constexpr unsigned STREAM_BUFFER_COUNT = 3;
+constexpr GLsizeiptr MIN_STREAM_BUFFER_CAPACITY = 4096;
+constexpr std::size_t MAX_DAMAGE_RECTS = 8;
+constexpr std::chrono::milliseconds FRAME_PERIOD{16};
+constexpr GLint TO_LINEAR_TEXTURE_UNIT = 3;
+constexpr GLint TO_SRGB_TEXTURE_UNIT = 4;
+constexpr unsigned IMAGE_ATLAS_SIZE = 512;
+constexpr unsigned FONT_ATLAS_WIDTH = 2048;
+constexpr std::size_t TEXT_CACHE_CAPACITY = 2 << 20;
+constexpr unsigned FONT_PRECISION = 16;
+constexpr unsigned GLYPH_PAGE_SIZE = 1024;
+constexpr std::size_t MAX_GLYPH_PAGES = 4;
+constexpr std::size_t ASSET_UPLOAD_BUDGET = 512 << 10;
 
 #define HCC_GRAPHICS_TO_LINEAR \
 "vec3 toLinear(vec3 color)\n" \
@@ -59,6 +93,49 @@ constexpr std::uint32_t CC_LAST = 0xefff;
 "        vec3(1.055) * pow(color, vec3(1.0 / 2.4)) - vec3(0.055),\n" \
 "        vec3(greaterThan(color, vec3(0.0031308))));\n" \
 "}\n"
+#define HCC_GRAPHICS_LOOKUP \
+"float lookup(sampler2D table, float x)\n" \
+"{\n" \
+"    vec2 v = texture2D(table, vec2(x * (255.0 / 256.0) + (0.5 / 256.0), 0.5)).ra;\n" \
+"    return dot(v, vec2(65280.0 / 65535.0, 255.0 / 65535.0));\n" \
+"}\n"
+#define HCC_GRAPHICS_TO_LINEAR_LOOKUP \
+"uniform sampler2D u_ToLinear;\n" \
+"vec3 toLinear(vec3 color)\n" \
+"{\n" \
+"    return vec3(lookup(u_ToLinear, color.r), lookup(u_ToLinear, color.g), lookup(u_ToLinear, color.b));\n" \
+"}\n"
+#define HCC_GRAPHICS_TO_SRGB_LOOKUP \
+"uniform sampler2D u_TosRGB;\n" \
+"vec3 tosRGB(vec3 color)\n" \
+"{\n" \
+"    vec3 s = sqrt(color);\n" \
+"    return vec3(lookup(u_TosRGB, s.r), lookup(u_TosRGB, s.g), lookup(u_TosRGB, s.b));\n" \
+"}\n"
+#define HCC_GRAPHICS_COLOR_CONVERSION \
+"#ifdef HCC_COLOR_LOOKUP\n" \
+HCC_GRAPHICS_LOOKUP \
+HCC_GRAPHICS_TO_LINEAR_LOOKUP \
+HCC_GRAPHICS_TO_SRGB_LOOKUP \
+"#else\n" \
+HCC_GRAPHICS_TO_LINEAR \
+HCC_GRAPHICS_TO_SRGB \
+"#endif\n"
+// Direct rendering blends with GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA into a
+// framebuffer that holds sRGB values. Given the destination color, this picks
+// the source color and alpha that make that blend land on the linear space
+// mix, raising alpha where the source would otherwise leave [0, 1].
+// linear_blend() in color.hpp does the same on the CPU for the tests.
+#define HCC_GRAPHICS_LINEAR_BLEND \
+"vec4 linearBlend(vec3 destination, vec3 color, float alpha)\n" \
+"{\n" \
+"    vec3 target = tosRGB(mix(toLinear(destination), toLinear(color), alpha));\n" \
+"    vec3 up = (target - destination) / max(vec3(1.0) - destination, vec3(0.001));\n" \
+"    vec3 down = (destination - target) / max(destination, vec3(0.001));\n" \
+"    vec3 needed = max(up, down);\n" \
+"    float a = clamp(max(alpha, max(needed.r, max(needed.g, needed.b))), alpha, 1.0);\n" \
+"    return vec4(clamp(destination + (target - destination) / a, 0.0, 1.0), a);\n" \
+"}\n"
 
 const std::string image_vertex_shader_source =
 #ifndef __APPLE__
@@ -67,29 +144,34 @@ const std::string image_vertex_shader_source =
 "uniform mat4 u_Projection;\n"
 "attribute vec4 a_Position;\n"
 "attribute vec2 a_TexCoord;\n"
+"attribute vec4 a_Tint;\n"
 "varying vec2 v_TexCoord;\n"
+"varying vec3 v_Tint;\n"
 "void main()\n"
 "{\n"
 "    v_TexCoord = a_TexCoord;\n"
+"    v_Tint = a_Tint.rgb;\n"
 "    gl_Position = u_Projection * a_Position;\n"
 "}\n";
 
+// alpha only textures sample as black, the tint gives them their color
 const std::string image_fragment_shader_source =
 #ifndef __APPLE__
 "#version 100\n"
 "precision mediump float;\n"
 #endif // __APPLE__
 "uniform sampler2D u_Texture;\n"
-"uniform vec3 u_BackgroundColor;\n"
+"uniform vec3 u_LinearBackgroundColor;\n"
 "varying vec2 v_TexCoord;\n"
-HCC_GRAPHICS_TO_LINEAR
-HCC_GRAPHICS_TO_SRGB
+"varying vec3 v_Tint;\n"
+HCC_GRAPHICS_COLOR_CONVERSION
 "void main()\n"
 "{\n"
 "    vec4 color = texture2D(u_Texture, v_TexCoord);\n"
+"    color.rgb += v_Tint;\n"
 "    if (color.a == 0.0)\n"
 "        discard;\n"
-"    gl_FragColor = vec4(tosRGB(mix(toLinear(u_BackgroundColor), toLinear(color.rgb), color.a)), 1);\n"
+"    gl_FragColor = vec4(tosRGB(mix(u_LinearBackgroundColor, toLinear(color.rgb), color.a)), 1);\n"
 "}\n";
 
 const std::string arc_vertex_shader_source =
@@ -116,9 +198,16 @@ const std::string arc_fragment_shader_source =
 "#version 100\n"
 "precision mediump float;\n"
 #endif // __APPLE__
+"#ifdef HCC_DIRECT\n"
+"uniform vec3 u_BackgroundColor;\n"
+"#endif\n"
 "varying vec4 v_Color;\n"
 "varying vec2 v_Position;\n"
 "varying vec4 v_Circle;\n"
+"#ifdef HCC_DIRECT\n"
+HCC_GRAPHICS_COLOR_CONVERSION
+HCC_GRAPHICS_LINEAR_BLEND
+"#endif\n"
 "float smoothStep(float edge0, float edge1, float x)\n"
 "{\n"
 "    float t = clamp((x - edge0) / (edge1  - edge0), 0.0, 1.0);\n"
@@ -136,7 +225,11 @@ const std::string arc_fragment_shader_source =
 "    float alpha = smoothSample();\n"
 "    if (alpha == 0.0)\n"
 "        discard;\n"
+"#ifdef HCC_DIRECT\n"
+"    gl_FragColor = linearBlend(u_BackgroundColor, v_Color.rgb, v_Color.a * alpha);\n"
+"#else\n"
 "    gl_FragColor = vec4(v_Color.rgb, v_Color.a * alpha);\n"
+"#endif\n"
 "}\n";
 
 const std::string font_vertex_shader_source =
@@ -147,12 +240,19 @@ const std::string font_vertex_shader_source =
 "attribute vec4 a_Position;\n"
 "attribute vec4 a_Color;\n"
 "attribute vec2 a_TexCoord;\n"
+"attribute vec4 a_Destination;\n"
 "varying vec4 v_Color;\n"
 "varying vec2 v_TexCoord;\n"
+"#ifdef HCC_DIRECT\n"
+"varying vec3 v_Destination;\n"
+"#endif\n"
 "void main()\n"
 "{\n"
 "    v_Color = a_Color;\n"
 "    v_TexCoord = a_TexCoord;\n"
+"#ifdef HCC_DIRECT\n"
+"    v_Destination = a_Destination.rgb;\n"
+"#endif\n"
 "    gl_Position = u_Projection * a_Position;\n"
 "}\n";
 
@@ -162,14 +262,29 @@ const std::string font_fragment_shader_source =
 "precision mediump float;\n"
 #endif // __APPLE__
 "uniform sampler2D u_Texture;\n"
+"#ifdef HCC_SDF\n"
+"uniform float u_Smoothing;\n"
+"#endif\n"
 "varying vec4 v_Color;\n"
 "varying vec2 v_TexCoord;\n"
+"#ifdef HCC_DIRECT\n"
+"varying vec3 v_Destination;\n"
+HCC_GRAPHICS_COLOR_CONVERSION
+HCC_GRAPHICS_LINEAR_BLEND
+"#endif\n"
 "void main()\n"
 "{\n"
 "    float alpha = texture2D(u_Texture, v_TexCoord).a;\n"
+"#ifdef HCC_SDF\n"
+"    alpha = smoothstep(0.5 - u_Smoothing, 0.5 + u_Smoothing, alpha);\n"
+"#endif\n"
 "    if (alpha == 0.0)\n"
 "        discard;\n"
+"#ifdef HCC_DIRECT\n"
+"    gl_FragColor = linearBlend(v_Destination, v_Color.rgb, v_Color.a * alpha);\n"
+"#else\n"
 "    gl_FragColor = vec4(v_Color.rgb, v_Color.a * alpha);\n"
+"#endif\n"
 "}\n";
 
 const std::string combine_vertex_shader_source =
@@ -195,8 +310,7 @@ const std::string combine_fragment_shader_source =
 "uniform sampler2D u_ArcTexture;\n"
 "uniform sampler2D u_FontTexture;\n"
 "varying vec2 v_TexCoord;\n"
-HCC_GRAPHICS_TO_LINEAR
-HCC_GRAPHICS_TO_SRGB
+HCC_GRAPHICS_COLOR_CONVERSION
 "void main()\n"
 "{\n"
 "    vec3 imageColor = texture2D(u_ImageTexture, v_TexCoord).rgb;\n"
@@ -217,6 +331,19 @@ const EGLint DISPLAY_ATTRIBUTES[] =
     EGL_NONE
 };
 
+const EGLint PRESERVED_DISPLAY_ATTRIBUTES[] =
+{
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_SURFACE_TYPE,    EGL_WINDOW_BIT | EGL_SWAP_BEHAVIOR_PRESERVED_BIT,
+    EGL_RED_SIZE,        8,
+    EGL_GREEN_SIZE,      8,
+    EGL_BLUE_SIZE,       8,
+    EGL_ALPHA_SIZE,      8,
+    EGL_NONE
+};
+
+using SwapBuffersWithDamage = EGLBoolean (*)(EGLDisplay, EGLSurface, EGLint *, EGLint);
+
 const EGLint CONTEXT_ATTRIBUTES[] =
 {
     EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -225,62 +352,257 @@ const EGLint CONTEXT_ATTRIBUTES[] =
 
 #endif
 
+struct ImageVertex
+{
+    GLfloat x, y;
+    GLfloat s, t;
+    std::array<GLubyte, 4> tint;
+};
+
+struct ArcVertex
+{
+    GLfloat x, y;
+    std::array<GLubyte, 4> color;
+    std::array<GLfloat, 4> circle;
+};
+
+struct FontVertex
+{
+    GLfloat x, y;
+    std::array<GLubyte, 4> color;
+    GLfloat s, t;
+    // what is under the glyph in direct rendering, filled in before each frame is drawn
+    std::array<GLubyte, 4> destination;
+};
+
+struct VertexAttrib
+{
+    const char *name;
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    std::size_t offset;
+};
+
+const std::array<VertexAttrib, 3> IMAGE_VERTEX_ATTRIBS{{
+    {"a_Position", 2, GL_FLOAT, GL_FALSE, offsetof(ImageVertex, x)},
+    {"a_TexCoord", 2, GL_FLOAT, GL_FALSE, offsetof(ImageVertex, s)},
+    {"a_Tint", 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(ImageVertex, tint)}}};
+
+const std::array<VertexAttrib, 3> ARC_VERTEX_ATTRIBS{{
+    {"a_Position", 2, GL_FLOAT, GL_FALSE, offsetof(ArcVertex, x)},
+    {"a_Color", 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(ArcVertex, color)},
+    {"a_Circle", 4, GL_FLOAT, GL_FALSE, offsetof(ArcVertex, circle)}}};
+
+const std::array<VertexAttrib, 4> FONT_VERTEX_ATTRIBS{{
+    {"a_Position", 2, GL_FLOAT, GL_FALSE, offsetof(FontVertex, x)},
+    {"a_Color", 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(FontVertex, color)},
+    {"a_TexCoord", 2, GL_FLOAT, GL_FALSE, offsetof(FontVertex, s)},
+    {"a_Destination", 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(FontVertex, destination)}}};
+
+using CombineVertex = std::array<GLfloat, 2>;
+
+const std::array<VertexAttrib, 1> COMBINE_VERTEX_ATTRIBS{{
+    {"a_Position", 2, GL_FLOAT, GL_FALSE, 0}}};
+
+// attribute locations are bound to their indices in the *_VERTEX_ATTRIBS
+// arrays and uniform locations are looked up once after linking
+struct Program
+{
+    GLuint vertex_shader{};
+    GLuint fragment_shader{};
+    GLuint id{};
+    GLint projection = -1;
+    GLint screen_size = -1;
+    GLint background_color = -1;
+    GLint linear_background_color = -1;
+    GLint smoothing = -1;
+};
+
+// a ring of buffers written with glBufferSubData so that the driver
+// does not have to reallocate storage or wait for the previous frame
+struct StreamBuffer
+{
+    std::array<GLuint, STREAM_BUFFER_COUNT> buffers{};
+    std::array<GLsizeiptr, STREAM_BUFFER_COUNT> capacities{};
+    unsigned current{};
+
+    GLuint buffer() const { return buffers[current]; }
+};
+
+// framebuffer pixels, x1 and y1 exclusive
+struct Rect
+{
+    GLint x0{}, y0{}, x1{}, y1{};
+};
+
+// a submitted quad identified by its vertex data and texture
+struct DamageItem
+{
+    std::uint64_t hash{};
+    Rect rect;
+
+    bool operator<(const DamageItem& other) const
+    {
+        return std::tie(hash, rect.x0, rect.y0, rect.x1, rect.y1) < std::tie(other.hash, other.rect.x0, other.rect.y0, other.rect.x1, other.rect.y1);
+    }
+};
+
+// offset and size are in quads, glyphs with a nonzero smoothing come from a signed distance field
 struct FontDrawCall
 {
     GLint offset{};
     GLsizei size{};
     GLuint texture{};
+    GLfloat smoothing{};
     FontDrawCall() = default;
-    FontDrawCall(GLint offset, GLsizei size, GLuint texture) : offset(offset), size(size), texture(texture) { }
+    FontDrawCall(GLint offset, GLsizei size, GLuint texture, GLfloat smoothing)
+        : offset(offset), size(size), texture(texture), smoothing(smoothing) { }
+};
+
+struct GlyphSlot
+{
+    std::uint32_t code{};
+    std::uint64_t frame{};
+    std::list<unsigned>::iterator lru;
 };
 
-struct FontImage
+// Glyphs outside the preloaded charset, rendered on first use. Every glyph
+// takes a slot of precision cells, one per variant, big enough for any glyph of the face.
+struct GlyphCache
 {
-    unsigned width{}, height{};
-    std::vector<std::uint8_t> alpha;
+    FT_Face face{};
+    FT_Size size{};
+    unsigned cell_width{}, cell_height{}, columns{}, slots_per_page{};
+    std::vector<GLuint> pages;
+    std::vector<GlyphSlot> slots;
+    std::vector<unsigned> char_slots;
+    std::list<unsigned> lru;
+};
 
-    FontImage() = default;
-    FontImage(unsigned width, unsigned height)
-        : width(width), height(height), alpha(width * height, 0) { }
+struct Font : FontMetrics
+{
+    std::vector<GLuint> textures;
+    GlyphTable glyphs;
+    std::string path;
+    std::int64_t size{}, mode{};
+    GLfloat smoothing{};
+    GlyphCache cache;
+    bool ready{true};
 };
 
-struct FontGlyph
+// signed distance fields of a face shared by all its sizes
+struct SdfFace
 {
-    int img_x{}, img_y{}, img_width{}, img_height{};
+    std::string path;
+    SdfFont font;
+    GLuint texture{};
 };
-struct FontChar
+
+struct TextKey
 {
-    int bearing_x{}, bearing_y{}, advance_x{};
-    std::vector<FontGlyph> glyphs;
+    std::int64_t font_id{}, width{}, height{}, align{}, valign{};
+    std::array<std::int64_t, 4> color{};
+    std::string text;
+
+    bool operator==(const TextKey& other) const
+    {
+        return std::tie(font_id, width, height, align, valign, color, text) ==
+            std::tie(other.font_id, other.width, other.height, other.align, other.valign, other.color, other.text);
+    }
 };
 
+struct TextKeyHash
+{
+    std::size_t operator()(const TextKey& key) const
+    {
+        auto hash = std::hash<std::string>()(key.text);
+        for (auto v : {key.font_id, key.width, key.height, key.align, key.valign, key.color[0], key.color[1], key.color[2], key.color[3]})
+            hash = hash * 31 + std::size_t(v);
+        return hash;
+    }
+};
 
-struct RasterizedFont
+// vertices of a laid out text with its origin at (0, 0), draw call offsets relative to the first quad
+struct TextRun
 {
-    int precision{};
-    int capital_ascender{};
-    FontImage image;
-    std::unordered_map<std::uint32_t, std::unordered_map<std::uint32_t, int>> kerning;
-    std::unordered_map<std::uint32_t, FontChar> chars;
+    std::vector<FontVertex> vertices;
+    std::vector<FontDrawCall> draw_calls;
+    std::vector<std::uint16_t> cached_chars;
+    std::list<const TextKey *>::iterator lru;
 };
 
-struct Font
+struct AtlasPage
 {
-    int precision{};
-    int ascender{}, descender{}, height{}, center{}, baseline_center{};
-    int texture_width{}, texture_height{};
-    GLuint texture;
-    std::unordered_map<std::uint32_t, std::unordered_map<std::uint32_t, int>> kerning;
-    std::unordered_map<std::uint32_t, FontChar> chars;
+    GLuint texture{};
+    ShelfPacker packer;
 };
 
 struct Image
 {
-    int texture_width{}, texture_height{};
+    int width{}, height{};
     GLuint texture{};
+    int atlas_x{}, atlas_y{}, atlas_width{}, atlas_height{};
+    std::array<GLubyte, 4> tint{};
+    bool ready{true};
+};
+
+// a decoded or rasterized asset waiting for render() to upload it
+struct AssetUpload
+{
+    std::size_t bytes{};
+    std::function<void()> upload;
+};
+
+using AssetJob = std::function<AssetUpload(FT_Library freetype, std::list<FontFile>& font_files)>;
+
+// Runs asset jobs on a background thread. FreeType objects are not shared
+// between threads, so the thread has its own library and font files.
+struct AssetLoader
+{
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<AssetJob> jobs;
+    std::deque<AssetUpload> uploads;
+    bool stop{};
+    std::thread thread{[this] { run(); }};
+
+    AssetLoader() = default;
+    AssetLoader(const AssetLoader&) = delete;
+    AssetLoader& operator=(const AssetLoader&) = delete;
+
+    ~AssetLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
 
-    Image() = default;
-    Image(int width, int height, GLuint texture) : texture_width(width), texture_height(height), texture(texture) {}
+    void run()
+    {
+        FT_Library freetype;
+        FT_Init_FreeType(&freetype);
+        {
+            std::list<FontFile> font_files;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                wake.wait(lock, [this] { return stop || !jobs.empty(); });
+                if (stop)
+                    break;
+                auto job = std::move(jobs.front());
+                jobs.pop_front();
+                lock.unlock();
+                auto upload = job(freetype, font_files);
+                lock.lock();
+                uploads.push_back(std::move(upload));
+            }
+        }
+        FT_Done_FreeType(freetype);
+    }
 };
 
 struct State
@@ -296,51 +618,88 @@ struct State
     FT_Library freetype;
 
     std::vector<Font> fonts;
+    std::vector<SdfFace> sdf_faces;
+    std::list<FontFile> font_files;
     std::vector<Image> images;
-
-    std::vector<GLfloat> image_vertices;
-    std::vector<GLfloat> image_coords;
-    std::vector<GLfloat> arc_vertices;
-    std::vector<GLfloat> arc_colors;
-    std::vector<GLfloat> arc_circles;
-    std::vector<GLfloat> font_vertices;
-    std::vector<GLfloat> font_colors;
-    std::vector<GLfloat> font_coords;
-    GLuint image_vertex_buffer{};
-    GLuint image_coord_buffer{};
+    // a set of pages for each image format
+    std::array<std::vector<AtlasPage>, IMAGE_FORMAT_COUNT> image_atlas;
+    std::vector<std::unique_ptr<MappedFile>> asset_packs;
+    std::unordered_map<std::string, PackedImage> packed_images;
+    std::vector<AtlasPage> font_atlas;
+    bool shared_font_atlas{true};
+    unsigned font_threads{std::max(std::thread::hardware_concurrency(), 1u)};
+    std::vector<TextLine> text_lines;
+    std::unordered_map<TextKey, TextRun, TextKeyHash> text_cache;
+    std::list<const TextKey *> text_lru;
+    std::size_t text_cache_size{}, text_cache_capacity{TEXT_CACHE_CAPACITY};
+    std::vector<FontDrawCall> text_draw_calls;
+    std::vector<std::uint16_t> text_cached_chars;
+
+    std::vector<ImageVertex> image_vertices;
+    std::vector<ArcVertex> arc_vertices;
+    std::vector<FontVertex> font_vertices;
+    StreamBuffer image_vertex_buffer;
     std::vector<FontDrawCall> image_draw_calls;
-    GLuint arc_vertex_buffer{};
-    GLuint arc_color_buffer{};
-    GLuint arc_circle_buffer{};
-    GLuint font_vertex_buffer{};
-    GLuint font_color_buffer{};
-    GLuint font_coord_buffer{};
+    StreamBuffer arc_vertex_buffer;
+    StreamBuffer font_vertex_buffer;
     std::vector<FontDrawCall> font_draw_calls;
     GLuint combine_vertex_buffer{};
+    GLuint quad_index_buffer{};
 
-    GLuint image_vertex_shader{};
-    GLuint image_fragment_shader{};
-    GLuint image_program{};
-    GLuint arc_vertex_shader{};
-    GLuint arc_fragment_shader{};
-    GLuint arc_program{};
-    GLuint font_vertex_shader{};
-    GLuint font_fragment_shader{};
-    GLuint font_program{};
-    GLuint combine_vertex_shader{};
-    GLuint combine_fragment_shader{};
-    GLuint combine_program{};
+    Program image_program;
+    Program arc_program;
+    Program font_program;
+    Program sdf_program;
+    Program direct_arc_program;
+    Program direct_font_program;
+    Program direct_sdf_program;
+    Program combine_program;
 
     std::array<GLfloat, 16> projection{};
 
-    GLuint image_fbo;
-    GLuint image_texture;
-    GLuint arc_fbo;
-    GLuint arc_texture;
-    GLuint font_fbo;
-    GLuint font_texture;
+    bool direct_rendering{};
+    // whether this frame is drawn directly, direct rendering falls back to the layers for some frames
+    bool direct_frame{};
+    GLuint image_fbo{};
+    GLuint image_texture{};
+    GLuint arc_fbo{};
+    GLuint arc_texture{};
+    GLuint font_fbo{};
+    GLuint font_texture{};
 
     std::array<GLfloat, 3> clear_color{};
+    std::array<GLfloat, 3> linear_clear_color{};
+
+    bool color_lookup{};
+    GLuint to_linear_texture{};
+    GLuint to_srgb_texture{};
+
+    bool preserved_backbuffer{};
+#ifndef __APPLE__
+    SwapBuffersWithDamage swap_buffers_with_damage{};
+#endif // __APPLE__
+    bool full_damage = true;
+    std::array<GLfloat, 3> previous_clear_color{};
+    std::vector<DamageItem> damage_items;
+    std::vector<DamageItem> previous_damage_items;
+    std::vector<DamageItem> changed_items;
+    std::vector<Rect> damage;
+    std::vector<Rect> screen_damage;
+    std::array<std::uint64_t, LAYER_COUNT> layer_hashes{};
+    std::array<bool, LAYER_COUNT> layer_changed{};
+    bool frame_changed{};
+    std::chrono::steady_clock::time_point last_swap;
+
+    std::uint64_t frame{1};
+    // counted while a frame is built and reported by the next render()
+    std::array<std::int64_t, STAT_COUNT> frame_stats{};
+    std::array<std::int64_t, STAT_COUNT> stats{};
+
+    std::vector<std::int64_t> preloaded_ids;
+    std::size_t asset_upload_budget{ASSET_UPLOAD_BUDGET};
+    std::size_t pending_assets{};
+    // last, so its thread stops before anything else goes
+    std::unique_ptr<AssetLoader> asset_loader;
 };
 
 State *state = nullptr;
@@ -354,19 +713,41 @@ void init_projection(int width, int height)
         -1,           -1,            0, 1
     }};
     state->projection = m;
+
+    std::array<GLfloat, 2> screen_size{{GLfloat(width), GLfloat(height)}};
+    for (auto program : {&state->image_program, &state->arc_program, &state->font_program, &state->sdf_program,
+                         &state->direct_arc_program, &state->direct_font_program, &state->direct_sdf_program, &state->combine_program})
+    {
+        glUseProgram(program->id);
+        glUniformMatrix4fv(program->projection, 1, false, state->projection.data());
+        if (program->screen_size != -1)
+            glUniform2fv(program->screen_size, 1, screen_size.data());
+    }
 }
 
 void init_buffers()
 {
-    glGenBuffers(1, &state->image_vertex_buffer);
-    glGenBuffers(1, &state->image_coord_buffer);
-    glGenBuffers(1, &state->arc_vertex_buffer);
-    glGenBuffers(1, &state->arc_color_buffer);
-    glGenBuffers(1, &state->arc_circle_buffer);
-    glGenBuffers(1, &state->font_vertex_buffer);
-    glGenBuffers(1, &state->font_color_buffer);
-    glGenBuffers(1, &state->font_coord_buffer);
+    glGenBuffers(STREAM_BUFFER_COUNT, state->image_vertex_buffer.buffers.data());
+    glGenBuffers(STREAM_BUFFER_COUNT, state->arc_vertex_buffer.buffers.data());
+    glGenBuffers(STREAM_BUFFER_COUNT, state->font_vertex_buffer.buffers.data());
     glGenBuffers(1, &state->combine_vertex_buffer);
+    glGenBuffers(1, &state->quad_index_buffer);
+
+    GLfloat screen_width = state->display_width * state->display_scale;
+    GLfloat screen_height = state->display_height * state->display_scale;
+    std::array<GLfloat, 8> screen_vertices{{0, 0, screen_width, 0, screen_width, screen_height, 0, screen_height}};
+    glBindBuffer(GL_ARRAY_BUFFER, state->combine_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(screen_vertices), screen_vertices.data(), GL_STATIC_DRAW);
+
+    std::vector<GLushort> indices;
+    indices.reserve(MAX_QUADS_PER_DRAW * 6);
+    for (unsigned i = 0; i < unsigned(MAX_QUADS_PER_DRAW) * 4; i += 4)
+    {
+        std::array<GLushort, 6> quad{{GLushort(i), GLushort(i + 1), GLushort(i + 2), GLushort(i), GLushort(i + 2), GLushort(i + 3)}};
+        indices.insert(end(indices), begin(quad), end(quad));
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state->quad_index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices[0]) * indices.size(), indices.data(), GL_STATIC_DRAW);
 }
 
 std::pair<GLuint, GLuint> create_framebuffer(GLenum format)
@@ -402,6 +783,64 @@ void init_framebuffers()
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+void free_framebuffers()
+{
+    std::array<GLuint, 3> fbos{{state->image_fbo, state->arc_fbo, state->font_fbo}};
+    std::array<GLuint, 3> textures{{state->image_texture, state->arc_texture, state->font_texture}};
+    glDeleteFramebuffers(fbos.size(), fbos.data());
+    glDeleteTextures(textures.size(), textures.data());
+    state->image_fbo = state->arc_fbo = state->font_fbo = 0;
+    state->image_texture = state->arc_texture = state->font_texture = 0;
+}
+
+// 256 entries of 16-bit values split into the luminance (high byte) and alpha (low byte) channels
+template <typename F>
+GLuint create_lookup_texture(F f)
+{
+    std::array<GLubyte, 256 * 2> data;
+    for (unsigned i = 0; i < 256; ++i)
+    {
+        auto v = std::lround(std::min(std::max(f(i / 255.0), 0.0), 1.0) * 65535);
+        data[i * 2] = v >> 8;
+        data[i * 2 + 1] = v & 0xff;
+    }
+    GLuint texture{};
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, 256, 1, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, data.data());
+    return texture;
+}
+
+// The lookup textures replace pow() in the image and combine shaders. They
+// stay bound to their own texture units, which is possible when the GPU has
+// enough of them; otherwise the shaders fall back to computing the curves.
+void init_color_lookup()
+{
+    GLint texture_units{};
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &texture_units);
+    state->color_lookup = texture_units > TO_SRGB_TEXTURE_UNIT;
+    if (!state->color_lookup)
+        return;
+
+    glActiveTexture(GL_TEXTURE0 + TO_LINEAR_TEXTURE_UNIT);
+    state->to_linear_texture = create_lookup_texture(to_linear);
+    glActiveTexture(GL_TEXTURE0 + TO_SRGB_TEXTURE_UNIT);
+    // indexed by the square root of the linear value to keep the precision of dark colors
+    state->to_srgb_texture = create_lookup_texture([](double s) { return to_srgb(s * s); });
+    glActiveTexture(GL_TEXTURE0);
+}
+
+std::string with_defines(const std::string& source, const std::string& defines)
+{
+    // #version has to stay on the first line
+    std::size_t pos = source.compare(0, 8, "#version") == 0 ? source.find('\n') + 1 : 0;
+    return source.substr(0, pos) + defines + source.substr(pos);
+}
+
 GLuint create_shader(GLenum type, const std::string& source)
 {
     auto id = glCreateShader(type);
@@ -422,11 +861,17 @@ GLuint create_shader(GLenum type, const std::string& source)
     return id;
 }
 
-GLuint create_program(GLuint vs, GLuint fs)
+template <std::size_t N>
+Program create_program(const std::string& vs_source, const std::string& fs_source, const std::array<VertexAttrib, N>& attribs)
 {
+    Program p;
+    p.vertex_shader = create_shader(GL_VERTEX_SHADER, vs_source);
+    p.fragment_shader = create_shader(GL_FRAGMENT_SHADER, fs_source);
     auto program = glCreateProgram();
-    glAttachShader(program, vs);
-    glAttachShader(program, fs);
+    glAttachShader(program, p.vertex_shader);
+    glAttachShader(program, p.fragment_shader);
+    for (GLuint i = 0; i < N; ++i)
+        glBindAttribLocation(program, i, attribs[i].name);
     glLinkProgram(program);
     GLint status;
     glGetProgramiv(program, GL_LINK_STATUS, &status);
@@ -439,321 +884,1190 @@ GLuint create_program(GLuint vs, GLuint fs)
 		std::cerr << "Program link error: " << log.data() << std::endl;
         std::abort();
 	}
-    return program;
+    p.id = program;
+    p.projection = glGetUniformLocation(program, "u_Projection");
+    p.screen_size = glGetUniformLocation(program, "u_ScreenSize");
+    p.background_color = glGetUniformLocation(program, "u_BackgroundColor");
+    p.linear_background_color = glGetUniformLocation(program, "u_LinearBackgroundColor");
+    p.smoothing = glGetUniformLocation(program, "u_Smoothing");
+    return p;
 }
 
-void init_shaders()
+void set_sampler(const Program& program, const char *name, GLint unit)
 {
-    state->image_vertex_shader = create_shader(GL_VERTEX_SHADER, image_vertex_shader_source);
-    state->image_fragment_shader = create_shader(GL_FRAGMENT_SHADER, image_fragment_shader_source);
-    state->image_program = create_program(state->image_vertex_shader, state->image_fragment_shader);
-
-    state->arc_vertex_shader = create_shader(GL_VERTEX_SHADER, arc_vertex_shader_source);
-    state->arc_fragment_shader = create_shader(GL_FRAGMENT_SHADER, arc_fragment_shader_source);
-    state->arc_program = create_program(state->arc_vertex_shader, state->arc_fragment_shader);
-
-    state->font_vertex_shader = create_shader(GL_VERTEX_SHADER, font_vertex_shader_source);
-    state->font_fragment_shader = create_shader(GL_FRAGMENT_SHADER, font_fragment_shader_source);
-    state->font_program = create_program(state->font_vertex_shader, state->font_fragment_shader);
+    glUseProgram(program.id);
+    glUniform1i(glGetUniformLocation(program.id, name), unit);
+}
 
-    state->combine_vertex_shader = create_shader(GL_VERTEX_SHADER, combine_vertex_shader_source);
-    state->combine_fragment_shader = create_shader(GL_FRAGMENT_SHADER, combine_fragment_shader_source);
-    state->combine_program = create_program(state->combine_vertex_shader, state->combine_fragment_shader);
+void init_shaders()
+{
+    std::string color_defines = state->color_lookup ? "#define HCC_COLOR_LOOKUP\n" : "";
+    state->image_program = create_program(image_vertex_shader_source, with_defines(image_fragment_shader_source, color_defines), IMAGE_VERTEX_ATTRIBS);
+    state->arc_program = create_program(arc_vertex_shader_source, arc_fragment_shader_source, ARC_VERTEX_ATTRIBS);
+    state->font_program = create_program(font_vertex_shader_source, font_fragment_shader_source, FONT_VERTEX_ATTRIBS);
+    state->sdf_program = create_program(font_vertex_shader_source, with_defines(font_fragment_shader_source, "#define HCC_SDF\n"), FONT_VERTEX_ATTRIBS);
+    std::string direct_defines = color_defines + "#define HCC_DIRECT\n";
+    state->direct_arc_program = create_program(arc_vertex_shader_source, with_defines(arc_fragment_shader_source, direct_defines), ARC_VERTEX_ATTRIBS);
+    state->direct_font_program = create_program(with_defines(font_vertex_shader_source, direct_defines),
+                                                with_defines(font_fragment_shader_source, direct_defines), FONT_VERTEX_ATTRIBS);
+    state->direct_sdf_program = create_program(with_defines(font_vertex_shader_source, direct_defines),
+                                               with_defines(font_fragment_shader_source, direct_defines + "#define HCC_SDF\n"), FONT_VERTEX_ATTRIBS);
+    state->combine_program = create_program(combine_vertex_shader_source, with_defines(combine_fragment_shader_source, color_defines), COMBINE_VERTEX_ATTRIBS);
+
+    set_sampler(state->image_program, "u_Texture", 0);
+    set_sampler(state->font_program, "u_Texture", 0);
+    set_sampler(state->sdf_program, "u_Texture", 0);
+    set_sampler(state->direct_font_program, "u_Texture", 0);
+    set_sampler(state->direct_sdf_program, "u_Texture", 0);
+    set_sampler(state->combine_program, "u_ImageTexture", 0);
+    set_sampler(state->combine_program, "u_ArcTexture", 1);
+    set_sampler(state->combine_program, "u_FontTexture", 2);
+    if (state->color_lookup)
+        for (auto program : {&state->image_program, &state->direct_arc_program, &state->direct_font_program,
+                             &state->direct_sdf_program, &state->combine_program})
+        {
+            set_sampler(*program, "u_ToLinear", TO_LINEAR_TEXTURE_UNIT);
+            set_sampler(*program, "u_TosRGB", TO_SRGB_TEXTURE_UNIT);
+        }
 }
 
-void set_vertex_attrib(GLuint program, const char *name, int size, GLuint buffer)
+template <typename Vertex, std::size_t N>
+void set_vertex_attribs(const std::array<VertexAttrib, N>& attribs, GLuint buffer, GLint first_vertex = 0)
 {
     glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    auto location = glGetAttribLocation(program, name);
-    glVertexAttribPointer(location, size, GL_FLOAT, false, 0, nullptr);
-    glEnableVertexAttribArray(location);
+    for (GLuint location = 0; location < N; ++location)
+    {
+        auto& attrib = attribs[location];
+        auto pointer = reinterpret_cast<const void *>(first_vertex * sizeof(Vertex) + attrib.offset);
+        glVertexAttribPointer(location, attrib.size, attrib.type, attrib.normalized, sizeof(Vertex), pointer);
+        glEnableVertexAttribArray(location);
+    }
+}
+
+template <typename Vertex, std::size_t N>
+void draw_quads(const std::array<VertexAttrib, N>& attribs, GLuint buffer, GLint first, GLsizei count, std::int64_t stat)
+{
+    if (first + count <= MAX_QUADS_PER_DRAW)
+    {
+        ++state->stats[stat];
+        glDrawElements(GL_TRIANGLES, count * 6, GL_UNSIGNED_SHORT, reinterpret_cast<const void *>(first * 6 * sizeof(GLushort)));
+        return;
+    }
+    // quads past the reach of 16-bit indices are drawn by moving the attribute pointers
+    while (count > 0)
+    {
+        auto n = std::min(count, MAX_QUADS_PER_DRAW);
+        set_vertex_attribs<Vertex>(attribs, buffer, first * 4);
+        ++state->stats[stat];
+        glDrawElements(GL_TRIANGLES, n * 6, GL_UNSIGNED_SHORT, nullptr);
+        first += n;
+        count -= n;
+    }
+    set_vertex_attribs<Vertex>(attribs, buffer);
 }
 
 template <typename Container>
-void set_buffer(GLuint buffer, const Container& data)
+void set_buffer(StreamBuffer& stream, const Container& data)
 {
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(data[0]) * data.size(), data.data(), GL_DYNAMIC_DRAW);
+    stream.current = (stream.current + 1) % STREAM_BUFFER_COUNT;
+    auto size = GLsizeiptr(sizeof(data[0]) * data.size());
+    auto& capacity = stream.capacities[stream.current];
+    glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+    if (size > capacity)
+    {
+        capacity = std::max(capacity, MIN_STREAM_BUFFER_CAPACITY);
+        while (capacity < size)
+            capacity *= 2;
+        glBufferData(GL_ARRAY_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+        ++state->stats[STAT_BUFFER_REALLOCATIONS];
+    }
+    if (size > 0)
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, data.data());
+    state->stats[STAT_UPLOADED_BYTES] += size;
 }
 
-GLuint create_texture(GLsizei width, GLsizei height, const void *data)
+void add_draw_call(std::vector<FontDrawCall>& draw_calls, GLint offset, GLsizei size, GLuint texture, GLfloat smoothing = 0)
 {
-    GLuint texture{};
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    if (size == 0)
+        return;
+    if (!draw_calls.empty() && draw_calls.back().texture == texture && draw_calls.back().smoothing == smoothing &&
+        draw_calls.back().offset + draw_calls.back().size == offset)
+        draw_calls.back().size += size;
+    else
+        draw_calls.emplace_back(offset, size, texture, smoothing);
+}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, data);
-    return texture;
+template <typename Vertex>
+void push_quad(std::vector<Vertex>& vertices, const Vertex& v0, const Vertex& v1, const Vertex& v2, const Vertex& v3)
+{
+    vertices.push_back(v0);
+    vertices.push_back(v1);
+    vertices.push_back(v2);
+    vertices.push_back(v3);
 }
 
+std::uint64_t hash_bytes(const void *data, std::size_t size, std::uint64_t hash = 14695981039346656037ull)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
 
-FontImage downscale(FT_Bitmap bitmap, unsigned n, unsigned offset, unsigned y_offset)
+Rect screen_rect()
 {
-    FontImage g{(bitmap.width + offset + (n - 1)) / n, (bitmap.rows + y_offset + (n - 1)) / n};
-    auto pitch = bitmap.pitch;
-    for (unsigned gy = 0; gy < g.height; ++gy)
-        for (unsigned gx = 0; gx < g.width; ++gx)
-        {
-            unsigned s = 0;
-            for (unsigned sy = (std::max(gy * n, y_offset) - y_offset) * pitch, msy = std::min((gy + 1) * n - y_offset, bitmap.rows) * pitch;
-                sy < msy;
-                sy += pitch)
-                s += std::accumulate(
-                    bitmap.buffer + std::max(gx * n, offset) - offset + sy,
-                    bitmap.buffer + std::min((gx + 1) * n - offset, bitmap.width) + sy, 0u);
-            g.alpha[gx + gy * g.width] = (s + (n * n) / 2) / (n * n);
-        }
-    return g;
+    return {0, 0, GLint(state->display_width * state->display_scale), GLint(state->display_height * state->display_scale)};
 }
 
-void blit(FontImage& dst, unsigned dx, unsigned dy, const FontImage& src)
+std::int64_t area(const Rect& r)
 {
-    if (dx >= dst.width)
-        return;
-    for (auto y = dy; y < std::min(dy + src.height, dst.height); ++y)
-        std::copy_n(src.alpha.data() + (y - dy) * src.width, std::min(src.width, dst.width - dx), dst.alpha.begin() + dx + y * dst.width);
+    return std::int64_t(r.x1 - r.x0) * (r.y1 - r.y0);
 }
 
-RasterizedFont rasterize_font(FT_Face face, const std::vector<std::uint32_t>& chars, unsigned precision)
+bool touch(const Rect& a, const Rect& b)
 {
-    RasterizedFont font;
-    font.precision = precision;
-    FontImage img{2048 * unsigned(state->display_scale), 2048};
-    unsigned dx = 0, dy = 0, row_height = 0;
-    bool too_big = false;
-    for (auto a : chars)
-        for (auto b : chars)
-        {
-            FT_Vector k{};
-            FT_Get_Kerning(face, FT_Get_Char_Index(face, a), FT_Get_Char_Index(face, b), FT_KERNING_UNFITTED, &k);
-            font.kerning[a][b] = (k.x + 31) / 64;
-        }
-    for (auto c : chars)
-    {
-        FT_Load_Char(face, c, FT_LOAD_RENDER);
-        FT_Glyph glyph;
-        FT_Get_Glyph(face->glyph, &glyph);
-        auto bg = (FT_BitmapGlyph)glyph;
+    return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+}
 
-        font.chars[c].glyphs.reserve(precision);
-        font.chars[c].bearing_x = face->glyph->metrics.horiBearingX / 64;
-        auto bearing_y = face->glyph->metrics.horiBearingY / 64;
-        font.chars[c].bearing_y = (bearing_y + precision - 1) / precision * precision;
-        font.chars[c].advance_x = face->glyph->metrics.horiAdvance / 64;
+Rect unite(const Rect& a, const Rect& b)
+{
+    return {std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1)};
+}
 
-        if (c == 'T')
-            font.capital_ascender = bearing_y;
+void add_damage(std::vector<Rect>& damage, Rect r)
+{
+    auto screen = screen_rect();
+    r = {std::max(r.x0, screen.x0), std::max(r.y0, screen.y0), std::min(r.x1, screen.x1), std::min(r.y1, screen.y1)};
+    if (r.x0 >= r.x1 || r.y0 >= r.y1)
+        return;
 
-        for (unsigned offset = 0; offset < precision; ++offset)
-        {
-            auto g = downscale(bg->bitmap, precision, offset, (font.precision - (bearing_y % font.precision)) % font.precision);
-            if ((dx + g.width) >= img.width)
+    for (auto merged = true; merged;)
+    {
+        merged = false;
+        for (auto it = damage.begin(); it != damage.end(); ++it)
+            if (touch(*it, r))
             {
-                dx = 0;
-                dy += row_height;
-                row_height = 0;
+                r = unite(*it, r);
+                damage.erase(it);
+                merged = true;
+                break;
             }
-            row_height = std::max(row_height, g.height);
-            blit(img, dx, dy, g);
-
-            if (dy + g.height > img.height)
-                too_big = true;
-
-            FontGlyph fg;
-            fg.img_x = dx;
-            fg.img_y = dy;
-            fg.img_width = g.width;
-            fg.img_height = g.height;
-            font.chars[c].glyphs.push_back(fg);
-
-            dx += g.width;
-        }
     }
+    damage.push_back(r);
 
-    if (too_big)
-        std::cerr << "error: font too big" << std::endl;
-
-    while (dy + row_height <= img.height / 2)
-        img.height /= 2;
+    if (damage.size() <= MAX_DAMAGE_RECTS)
+        return;
 
-    font.image = img;
-    return font;
+    std::size_t best_i = 0, best_j = 1;
+    auto best_growth = std::numeric_limits<std::int64_t>::max();
+    for (std::size_t i = 0; i < damage.size(); ++i)
+        for (std::size_t j = i + 1; j < damage.size(); ++j)
+        {
+            auto growth = area(unite(damage[i], damage[j])) - area(damage[i]) - area(damage[j]);
+            if (growth < best_growth)
+            {
+                best_growth = growth;
+                best_i = i;
+                best_j = j;
+            }
+        }
+    auto u = unite(damage[best_i], damage[best_j]);
+    damage.erase(damage.begin() + best_j);
+    damage.erase(damage.begin() + best_i);
+    add_damage(damage, u);
 }
 
-Font generate_font(FT_Face face, const std::vector<std::uint32_t>& chars, unsigned precision)
+template <typename Vertex>
+Rect quad_bounds(const Vertex *v)
 {
-    auto rf = rasterize_font(face, chars, precision);
-    Font f;
-    f.precision = rf.precision;
-    auto ascender = rf.capital_ascender ?
-        rf.capital_ascender * 64 :
-        FT_MulFix(face->ascender, face->size->metrics.y_scale);
-
-    f.ascender = (ascender + (32 * rf.precision - 1)) / (64 * rf.precision);
-    f.descender = -(FT_MulFix(-face->descender, face->size->metrics.y_scale) + (32 * rf.precision - 1)) / (64 * rf.precision);
-    f.height = f.ascender - f.descender;
-    f.center = (ascender - FT_MulFix(-face->descender, face->size->metrics.y_scale) + (64 * rf.precision - 1)) / (2 * 64 * rf.precision);
-    f.baseline_center = (ascender + (64 * rf.precision - 1)) / (2 * 64 * rf.precision);
-    f.texture_width = rf.image.width;
-    f.texture_height = rf.image.height;
-    f.texture = create_texture(rf.image.width, rf.image.height, rf.image.alpha.data());
-    f.kerning = rf.kerning;
-    f.chars = rf.chars;
-    return f;
+    auto x0 = std::min(std::min(v[0].x, v[1].x), std::min(v[2].x, v[3].x));
+    auto y0 = std::min(std::min(v[0].y, v[1].y), std::min(v[2].y, v[3].y));
+    auto x1 = std::max(std::max(v[0].x, v[1].x), std::max(v[2].x, v[3].x));
+    auto y1 = std::max(std::max(v[0].y, v[1].y), std::max(v[2].y, v[3].y));
+    return {GLint(std::floor(x0)), GLint(std::floor(y0)), GLint(std::ceil(x1)), GLint(std::ceil(y1))};
 }
 
-std::pair<std::uint32_t, std::int64_t> decode_utf8_char(const char *p)
+template <typename Vertex>
+void add_damage_items(const std::vector<Vertex>& vertices, GLint first, GLsizei count, std::uint64_t seed)
 {
-    const std::pair<std::uint32_t, std::int64_t> ERROR{0xffffffff, 1};
-    if ((*p & 0x80) == 0)
-        return {*p, 1};
-    if ((*p & 0x40) == 0 || (p[1] & 0x80) == 0)
-        return ERROR;
-    if ((*p & 0x20) == 0)
-        return {(p[1] & std::uint32_t(0x3f)) | ((p[0] & std::uint32_t(0x1f)) << 6), 2};
-    if ((p[2] & 0x80) == 0)
-        return ERROR;
-    if ((*p & 0x10) == 0)
-        return {(p[2] & std::uint32_t(0x3f)) | ((p[1] & std::uint32_t(0x3f)) << 6) | ((p[0] & std::uint32_t(0xf)) << 12), 3};
-    if ((*p & 8) == 1 || (p[3] & 0x80) == 0)
-        return ERROR;
-    return {(p[3] & std::uint32_t(0x3f)) | ((p[2] & std::uint32_t(0x3f)) << 6) | ((p[1] & std::uint32_t(0x3f)) << 12) | ((p[0] & std::uint32_t(7)) << 18), 4};
+    for (auto q = first; q < first + count; ++q)
+    {
+        auto v = vertices.data() + q * 4;
+        state->damage_items.push_back({hash_bytes(v, sizeof(Vertex) * 4, seed), quad_bounds(v)});
+    }
 }
 
+template <typename T>
+std::uint64_t hash_vector(const std::vector<T>& v, std::uint64_t hash = 14695981039346656037ull)
+{
+    return hash_bytes(v.data(), sizeof(T) * v.size(), hash);
+}
 
-struct TextLine
+void compute_layer_changes()
 {
-    std::int64_t width{};
-    const char *end{};
-    std::int64_t ws_count{};
-};
+    std::array<std::uint64_t, LAYER_COUNT> hashes{{
+        hash_bytes(state->clear_color.data(), sizeof(state->clear_color), hash_vector(state->image_draw_calls, hash_vector(state->image_vertices))),
+        hash_vector(state->arc_vertices),
+        hash_vector(state->font_draw_calls, hash_vector(state->font_vertices))}};
+    for (std::size_t i = 0; i < LAYER_COUNT; ++i)
+        state->layer_changed[i] = state->full_damage || hashes[i] != state->layer_hashes[i];
+    state->layer_hashes = hashes;
+}
 
-TextLine fit_text_line(const Font& font, std::int64_t max_width, const char *text)
+// Compares the quads submitted for this frame with the previous frame.
+// Arcs and glyphs never overlap, so only their content matters, while
+// images also depend on their drawing order.
+void compute_damage()
 {
-    std::int64_t width = 0;
-    TextLine last_break;
-    std::int64_t ws_count = 0;
-    std::uint32_t prev_ch = 0;
-    auto p = text;
-    while (*p && *p != '\n')
-    {
-        auto ch = decode_utf8_char(p);
-        if (ch.first >= CC_FIRST && ch.first <= CC_LAST)
+    state->damage_items.clear();
+    for (auto& dc : state->image_draw_calls)
+        for (auto q = dc.offset; q < dc.offset + dc.size; ++q)
         {
-            p += ch.second;
-            continue;
+            std::array<std::uint64_t, 3> key{{0, dc.texture, std::uint64_t(q)}};
+            add_damage_items(state->image_vertices, q, 1, hash_bytes(key.data(), sizeof(key)));
         }
-        if (font.chars.count(ch.first) == 0)
-            ch.first = '?';
-        if (ch.first == ' ')
-            last_break = {width, p, ws_count};
-        auto new_width = width;
-        if (prev_ch)
-            new_width += font.kerning.at(prev_ch).at(ch.first);
-        new_width += font.chars.at(ch.first).advance_x;
-        if (new_width > max_width && width > 0)
-            return last_break.end ? last_break : TextLine{width, p, ws_count};
-
-        if (ch.first == ' ')
-            ++ws_count;
-        width = new_width;
-        prev_ch = ch.first;
-        p += ch.second;
+    std::uint64_t arc_key = 1;
+    add_damage_items(state->arc_vertices, 0, state->arc_vertices.size() / 4, hash_bytes(&arc_key, sizeof(arc_key)));
+    for (auto& dc : state->font_draw_calls)
+    {
+        std::array<std::uint64_t, 2> key{{2, dc.texture}};
+        add_damage_items(state->font_vertices, dc.offset, dc.size, hash_bytes(key.data(), sizeof(key)));
+    }
+    std::sort(begin(state->damage_items), end(state->damage_items));
+
+    state->damage.clear();
+    if (state->full_damage || state->clear_color != state->previous_clear_color)
+        state->damage.push_back(screen_rect());
+    else
+    {
+        state->changed_items.clear();
+        std::set_symmetric_difference(
+            begin(state->damage_items), end(state->damage_items),
+            begin(state->previous_damage_items), end(state->previous_damage_items),
+            std::back_inserter(state->changed_items));
+        for (auto& item : state->changed_items)
+            add_damage(state->damage, item.rect);
+    }
+
+    std::int64_t dirty_pixels = 0;
+    for (auto& r : state->damage)
+        dirty_pixels += area(r);
+    if (dirty_pixels > area(screen_rect()) / 2)
+    {
+        state->damage.assign(1, screen_rect());
+        dirty_pixels = area(screen_rect());
     }
-    return {width, p, ws_count};
+    state->stats[STAT_DIRTY_PIXELS] = dirty_pixels;
+
+    // without a preserved back buffer the whole screen has to be redrawn,
+    // unless nothing changed and the frame is not going to be swapped at all
+    state->frame_changed = !state->damage.empty();
+    if (state->preserved_backbuffer || !state->frame_changed)
+        state->screen_damage = state->damage;
+    else
+        state->screen_damage.assign(1, screen_rect());
+
+    std::swap(state->damage_items, state->previous_damage_items);
+    state->previous_clear_color = state->clear_color;
+    state->full_damage = false;
 }
 
-std::int64_t newline_count(const Font& font, std::int64_t max_width, const char *text)
+template <typename Draw>
+void for_each_rect(const std::vector<Rect>& rects, bool clear, Draw draw)
 {
-    std::int64_t n = 0;
-    auto line = fit_text_line(font, max_width, text);
-    while (*line.end)
+    for (auto& r : rects)
     {
-        ++n;
-        if (*line.end == '\n' || *line.end == ' ')
-            ++line.end;
-        line = fit_text_line(font, max_width, line.end);
+        glScissor(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+        if (clear)
+            glClear(GL_COLOR_BUFFER_BIT);
+        draw();
     }
-    return n;
 }
 
-void push_glyph(const Font& font, const FontGlyph& glyph, GLfloat x, GLfloat y, std::int64_t c_r, std::int64_t c_g, std::int64_t c_b, std::int64_t c_a)
+GLuint create_atlas_texture(GLenum format, GLsizei width, GLsizei height)
 {
-    std::array<GLfloat, 12> vs{{
-            x, y - glyph.img_height,
-            x + glyph.img_width, y - glyph.img_height,
-            x + glyph.img_width, y,
-            x, y - glyph.img_height,
-            x + glyph.img_width, y,
-            x, y,
-        }};
-    std::array<GLfloat, 12> tc{{
-            GLfloat(glyph.img_x) / font.texture_width, GLfloat(glyph.img_y + glyph.img_height) / font.texture_height,
-            GLfloat(glyph.img_x + glyph.img_width) / font.texture_width, GLfloat(glyph.img_y + glyph.img_height) / font.texture_height,
-            GLfloat(glyph.img_x + glyph.img_width) / font.texture_width, GLfloat(glyph.img_y) / font.texture_height,
-            GLfloat(glyph.img_x) / font.texture_width, GLfloat(glyph.img_y + glyph.img_height) / font.texture_height,
-            GLfloat(glyph.img_x + glyph.img_width) / font.texture_width, GLfloat(glyph.img_y) / font.texture_height,
-            GLfloat(glyph.img_x) / font.texture_width, GLfloat(glyph.img_y) / font.texture_height,
-        }};
-    std::array<GLfloat, 4> color{{c_r / 255.0f, c_g / 255.0f, c_b / 255.0f, c_a / 255.0f}};
+    GLuint texture{};
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
 
-    ::state->font_vertices.insert(::state->font_vertices.end(), vs.begin(), vs.end());
-    ::state->font_coords.insert(::state->font_coords.end(), tc.begin(), tc.end());
-    for (int i = 0; i < 6; ++i)
-        ::state->font_colors.insert(end(::state->font_colors), begin(color), end(color));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    return texture;
 }
 
-std::int64_t push_char(const Font& font, std::uint32_t ch, std::int64_t pen_x, std::int64_t y, std::int64_t c_r, std::int64_t c_g, std::int64_t c_b, std::int64_t c_a)
+const AtlasPage& add_to_atlas(
+    std::vector<AtlasPage>& atlas, GLenum format, unsigned page_width, unsigned page_height,
+    unsigned width, unsigned height, const void *data, unsigned& x, unsigned& y)
 {
-    auto& char_ = font.chars.at(ch);
-    auto glyph_x = pen_x + char_.bearing_x;
-    auto glyph_x_rem = ((glyph_x % font.precision) + font.precision) % font.precision;
-    auto glyph_x_tr = (glyph_x - glyph_x_rem) / font.precision;
-    auto glyph = char_.glyphs.at(glyph_x_rem);
-    auto bearing_y = char_.bearing_y / font.precision;
-    push_glyph(font, glyph, glyph_x_tr, y + bearing_y, c_r, c_g, c_b, c_a);
-    return char_.advance_x;
+    GLint max_size{};
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    AtlasPlacement placement;
+    if (!place_in_atlas(atlas, page_width, page_height, unsigned(max_size), width, height, placement))
+    {
+        std::cerr << "texture too big: " << width << "x" << height << std::endl;
+        std::abort();
+    }
+    auto& page = atlas[placement.page];
+    if (placement.new_page)
+        page.texture = create_atlas_texture(format, page.packer.width, page.packer.height);
+    x = placement.x;
+    y = placement.y;
+    glBindTexture(GL_TEXTURE_2D, page.texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, GL_UNSIGNED_BYTE, data);
+    return page;
 }
 
+Image add_image(unsigned width, unsigned height, const void *pixels, std::uint32_t format = IMAGE_FORMAT_RGBA, std::array<GLubyte, 3> tint = {})
+{
+    static const std::array<GLenum, IMAGE_FORMAT_COUNT> gl_formats{{GL_ALPHA, GL_RGB, GL_RGBA}};
+    Image img;
+    unsigned x{}, y{};
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    auto& page = add_to_atlas(state->image_atlas[format], gl_formats[format], IMAGE_ATLAS_SIZE, IMAGE_ATLAS_SIZE, width, height, pixels, x, y);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    img.width = width;
+    img.height = height;
+    img.tint = {{tint[0], tint[1], tint[2], 0}};
+    img.texture = page.texture;
+    img.atlas_x = x;
+    img.atlas_y = y;
+    img.atlas_width = page.packer.width;
+    img.atlas_height = page.packer.height;
+    return img;
 }
 
-extern "C"
+void push_image(
+    const Image& img,
+    std::int64_t sx, std::int64_t sy, std::int64_t sw, std::int64_t sh,
+    std::int64_t x, std::int64_t y,
+    std::int64_t anchor, std::int64_t vanchor)
 {
+    sx = std::min<std::int64_t>(std::max<std::int64_t>(sx, 0), img.width);
+    sy = std::min<std::int64_t>(std::max<std::int64_t>(sy, 0), img.height);
+    sw = std::min<std::int64_t>(sw, img.width - sx);
+    sh = std::min<std::int64_t>(sh, img.height - sy);
+    if (sw <= 0 || sh <= 0)
+        return;
+    if (anchor > 0)
+        x -= sw;
+    else if (anchor == 0)
+        x -= sw / 2;
+    if (vanchor > 0)
+        y -= sh;
+    else if (vanchor == 0)
+        y -= sh / 2;
+    x *= state->display_scale;
+    y *= state->display_scale;
+    auto width = sw * state->display_scale;
+    auto height = sh * state->display_scale;
+    auto uv = atlas_coords(img.atlas_width, img.atlas_height, img.atlas_x + sx, img.atlas_y + sy, sw, sh);
+    add_draw_call(state->image_draw_calls, state->image_vertices.size() / 4, 1, img.texture);
+    push_quad(state->image_vertices,
+              ImageVertex{GLfloat(x), GLfloat(y), uv.s0, uv.t0, img.tint},
+              ImageVertex{GLfloat(x) + width, GLfloat(y), uv.s1, uv.t0, img.tint},
+              ImageVertex{GLfloat(x) + width, GLfloat(y) + height, uv.s1, uv.t1, img.tint},
+              ImageVertex{GLfloat(x), GLfloat(y) + height, uv.s0, uv.t1, img.tint});
+}
 
-std::int64_t get_display_width()
+GLuint create_texture(GLsizei width, GLsizei height, const void *data)
 {
-    if (!state)
-        return 0;
-    return state->display_width;
+    GLuint texture{};
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, data);
+    return texture;
 }
 
-std::int64_t get_display_height()
+
+void set_glyph_uvs(FontGlyph& g, unsigned x, unsigned y, unsigned texture_width, unsigned texture_height)
 {
-    if (!state)
-        return 0;
-    return state->display_height;
+    g.s0 = GLfloat(x + g.img_x) / texture_width;
+    g.s1 = GLfloat(x + g.img_x + g.img_width) / texture_width;
+    g.t0 = GLfloat(y + g.img_y + g.img_height) / texture_height;
+    g.t1 = GLfloat(y + g.img_y) / texture_height;
 }
 
-std::int64_t initialize_graphics(std::int64_t display_width, std::int64_t display_height, std::int64_t scale)
+// A new shared page is tall enough for the rest of the glyph pages of the
+// font being added and at least as tall as the pages before it together, so
+// pages stay few while no more than half of the atlas goes unused.
+unsigned font_atlas_height(const RasterizedFont& rf, std::size_t first_page)
 {
-    std::unique_ptr<State> state{new State};
-    state->display_scale = scale;
-
-#ifndef __APPLE__
-    bcm_host_init();
-
-    graphics_get_display_size(0, &state->display_width, &state->display_height);
-
-    state->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-    eglInitialize(state->display, nullptr, nullptr);
+    unsigned needed = 0, previous = 0;
+    for (auto i = first_page; i < rf.pages.size(); ++i)
+        needed += rf.pages[i].height;
+    for (auto& page : state->font_atlas)
+        previous += page.packer.height;
+    auto height = std::max(needed, previous);
+    GLint max_size{};
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    return std::min(height, unsigned(max_size));
+}
 
-    EGLint num_configs;
-    EGLConfig config;
-    eglChooseConfig(state->display, DISPLAY_ATTRIBUTES, &config, 1, &num_configs);
+Font generate_font(RasterizedFont& rf, const std::vector<const std::uint8_t *>& alpha)
+{
+    Font f;
+    static_cast<FontMetrics&>(f) = rf.metrics;
+    // where each page of the font went: x, y, texture width and height
+    std::vector<std::array<unsigned, 4>> placements;
+    for (std::size_t i = 0; i < rf.pages.size(); ++i)
+    {
+        auto& image = rf.pages[i];
+        std::array<unsigned, 4> placement{{0, 0, image.width, image.height}};
+        if (state->shared_font_atlas)
+        {
+            auto page_width = FONT_ATLAS_WIDTH * unsigned(state->display_scale);
+            auto& page = add_to_atlas(state->font_atlas, GL_ALPHA, page_width, font_atlas_height(rf, i), image.width, image.height, alpha[i], placement[0], placement[1]);
+            placement[2] = page.packer.width;
+            placement[3] = page.packer.height;
+            f.textures.push_back(page.texture);
+        }
+        else
+            f.textures.push_back(create_texture(image.width, image.height, alpha[i]));
+        placements.push_back(placement);
+    }
+    f.glyphs = std::move(rf.glyphs);
+    for (auto& g : f.glyphs.glyphs)
+    {
+        auto& p = placements[g.page];
+        set_glyph_uvs(g, p[0], p[1], p[2], p[3]);
+    }
+    return f;
+}
+
+// FONT_MODE_LINEAR moves glyphs by fractions of a texel, pixel aligned glyphs look the same either way
+void set_linear_filter(GLuint texture)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+void set_font_size(FT_Face face, std::int64_t size, std::int64_t mode, int scale)
+{
+    auto oversampling = font_oversampling(mode, FONT_PRECISION);
+    FT_Set_Char_Size(face, 0, size * oversampling * scale * 64, 131, 142);
+}
+
+// maps each font file once
+FontFile& font_file(std::list<FontFile>& files, const char *path)
+{
+    for (auto& file : files)
+        if (file.path == path)
+            return file;
+    files.emplace_back(path);
+    return files.back();
+}
+
+// opens a face per thread with new sizes, done_sizes() them after use
+std::vector<FT_Face> open_sized_faces(FontFile& file, FT_Library freetype, unsigned threads, std::vector<FT_Size>& sizes)
+{
+    if (!file.open_faces(freetype, threads))
+    {
+        std::cerr << "could not open font " << file.path << std::endl;
+        std::abort();
+    }
+    sizes = file.new_sizes(threads);
+    return std::vector<FT_Face>(begin(file.faces), begin(file.faces) + sizes.size());
+}
+
+// opens the font's size on the first face of its file and activates it
+bool open_glyph_cache(Font& font)
+{
+    auto& cache = font.cache;
+    if (cache.face)
+    {
+        FT_Activate_Size(cache.size);
+        return true;
+    }
+    auto& file = font_file(state->font_files, font.path.c_str());
+    if (font.mode == FONT_MODE_SDF || !file.open_faces(state->freetype, 1))
+        return false;
+    auto sizes = file.new_sizes(1);
+    if (sizes.empty())
+        return false;
+    cache.face = file.faces[0];
+    cache.size = sizes[0];
+    set_font_size(cache.face, font.size, font.mode, state->display_scale);
+    auto oversampling = font_oversampling(font.mode, font.precision);
+    auto padding = font.mode == FONT_MODE_LINEAR ? 2 * LINEAR_PADDING : 0;
+    auto& bbox = cache.face->bbox;
+    auto& metrics = cache.face->size->metrics;
+    cache.cell_width = FT_MulFix(bbox.xMax - bbox.xMin, metrics.x_scale) / (64 * oversampling) + 2 + padding;
+    cache.cell_height = FT_MulFix(bbox.yMax - bbox.yMin, metrics.y_scale) / (64 * oversampling) + 2 + padding;
+    cache.columns = GLYPH_PAGE_SIZE / cache.cell_width;
+    cache.slots_per_page = cache.columns * (GLYPH_PAGE_SIZE / cache.cell_height) / font_variants(font.mode, font.precision);
+    return true;
+}
+
+void touch_glyph(Font& font, std::uint16_t index)
+{
+    if (index < font.glyphs.dense_chars)
+        return;
+    auto& cache = font.cache;
+    auto& slot = cache.slots[cache.char_slots[index - font.glyphs.dense_chars]];
+    slot.frame = state->frame;
+    cache.lru.splice(begin(cache.lru), cache.lru, slot.lru);
+}
+
+void clear_text_cache();
+
+// takes a free slot, opens a new page or evicts the least recently used glyph not drawn in this frame
+bool allocate_glyph_slot(Font& font, unsigned& slot)
+{
+    auto& cache = font.cache;
+    auto capacity = cache.pages.size() * cache.slots_per_page;
+    if (cache.slots.size() == capacity && cache.slots_per_page > 0 && cache.pages.size() < MAX_GLYPH_PAGES)
+    {
+        cache.pages.push_back(create_atlas_texture(GL_ALPHA, GLYPH_PAGE_SIZE, GLYPH_PAGE_SIZE));
+        if (font.mode == FONT_MODE_LINEAR)
+            set_linear_filter(cache.pages.back());
+        capacity += cache.slots_per_page;
+    }
+    if (cache.slots.size() < capacity)
+    {
+        slot = cache.slots.size();
+        cache.slots.emplace_back();
+        cache.lru.push_front(slot);
+        cache.slots.back().lru = begin(cache.lru);
+        return true;
+    }
+    if (cache.lru.empty() || cache.slots[cache.lru.back()].frame == state->frame)
+        return false;
+    slot = cache.lru.back();
+    font.glyphs.remove_sparse_char(cache.slots[slot].code);
+    // cached text runs may still point at the evicted cells
+    clear_text_cache();
+    return true;
+}
+
+// sets full when the glyph exists but every slot holds a glyph drawn in this frame
+std::uint16_t add_glyph(Font& font, std::uint32_t code, bool& full)
+{
+    auto& cache = font.cache;
+    unsigned slot{};
+    if (!open_glyph_cache(font) || FT_Get_Char_Index(cache.face, code) == 0)
+        return GlyphTable::NONE;
+    if (!allocate_glyph_slot(font, slot))
+    {
+        full = true;
+        return GlyphTable::NONE;
+    }
+    ++state->frame_stats[STAT_GLYPH_MISSES];
+
+    FontChar metrics;
+    auto variants = render_char(cache.face, code, font.precision, font.mode, metrics);
+    auto index = font.glyphs.add_sparse_char(code, metrics);
+    auto char_slot = index - font.glyphs.dense_chars;
+    if (cache.char_slots.size() <= std::size_t(char_slot))
+        cache.char_slots.resize(char_slot + 1);
+    cache.char_slots[char_slot] = slot;
+    cache.slots[slot].code = code;
+    touch_glyph(font, index);
+
+    auto page = slot / cache.slots_per_page;
+    glBindTexture(GL_TEXTURE_2D, cache.pages[page]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (unsigned v = 0; v < variants.size(); ++v)
+    {
+        FontImage cell{cache.cell_width, cache.cell_height};
+        blit(cell, 0, 0, variants[v]);
+        auto c = slot % cache.slots_per_page * variants.size() + v;
+        auto x = c % cache.columns * cache.cell_width;
+        auto y = c / cache.columns * cache.cell_height;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, cell.width, cell.height, GL_ALPHA, GL_UNSIGNED_BYTE, cell.alpha.data());
+        state->frame_stats[STAT_UPLOADED_BYTES] += cell.alpha.size();
+
+        auto& g = font.glyphs.glyph(index, v);
+        g.set_image(x, y, std::min(variants[v].width, cell.width), std::min(variants[v].height, cell.height));
+        g.page = font.textures.size() + page;
+        set_glyph_uvs(g, 0, 0, GLYPH_PAGE_SIZE, GLYPH_PAGE_SIZE);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    if (font.mode == FONT_MODE_LINEAR)
+        share_linear_image(font.glyphs, index);
+    return index;
+}
+
+// Renders the glyphs of the text missing from the font and looks up the kerning of
+// the pairs involving them. Lists the glyphs outside the preloaded charset it uses.
+// Returns false when the glyph cache was full and some chars fell back to '?' for
+// this frame only, so the text must not be cached.
+bool add_missing_glyphs(Font& font, const char *text, std::vector<std::uint16_t>& cached_chars)
+{
+    auto& glyphs = font.glyphs;
+    auto prev = GlyphTable::NONE;
+    std::uint32_t prev_code{};
+    bool full = false;
+    cached_chars.clear();
+    while (*text)
+    {
+        auto ch = decode_utf8_char(text);
+        text += ch.second;
+        auto code = ch.first;
+        if (code >= CC_FIRST && code <= CC_LAST)
+            continue;
+        if (code == '\n')
+        {
+            prev = GlyphTable::NONE;
+            continue;
+        }
+        auto index = glyphs.find(code);
+        if (index == GlyphTable::NONE)
+            index = add_glyph(font, code, full);
+        if (index == GlyphTable::NONE)
+        {
+            index = glyphs.fallback;
+            code = '?';
+        }
+        if (index >= glyphs.dense_chars)
+        {
+            touch_glyph(font, index);
+            cached_chars.push_back(index);
+        }
+        if (prev != GlyphTable::NONE && (prev >= glyphs.dense_chars || index >= glyphs.dense_chars))
+        {
+            auto pair = GlyphTable::kerning_pair(prev, index);
+            if (glyphs.sparse_kerning.find(pair) == end(glyphs.sparse_kerning) && open_glyph_cache(font))
+                glyphs.set_kerning(prev, index, char_kerning(font.cache.face, prev_code, code, font.precision, font.mode));
+        }
+        prev = index;
+        prev_code = code;
+    }
+    std::sort(begin(cached_chars), end(cached_chars));
+    cached_chars.erase(std::unique(begin(cached_chars), end(cached_chars)), end(cached_chars));
+    return !full;
+}
+
+const SdfFace *find_sdf_face(const std::string& path)
+{
+    for (auto& face : state->sdf_faces)
+        if (face.path == path)
+            return &face;
+    return nullptr;
+}
+
+const SdfFace& add_sdf_face(const std::string& path, SdfFont font)
+{
+    if (auto found = find_sdf_face(path))
+        return *found;
+    SdfFace face;
+    face.path = path;
+    face.font = std::move(font);
+    auto& image = face.font.image;
+    face.texture = create_atlas_texture(GL_ALPHA, image.width, image.height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, GL_ALPHA, GL_UNSIGNED_BYTE, image.alpha.data());
+    // only the size is needed from now on
+    image.alpha = {};
+    state->sdf_faces.push_back(std::move(face));
+    return state->sdf_faces.back();
+}
+
+GLuint glyph_texture(const Font& font, const FontGlyph& glyph)
+{
+    auto page = std::size_t(glyph.page);
+    return page < font.textures.size() ? font.textures[page] : font.cache.pages[page - font.textures.size()];
+}
+
+void push_glyph(const FontGlyph& glyph, GLfloat x, GLfloat y, const std::array<GLubyte, 4>& color)
+{
+    push_quad(::state->font_vertices,
+              FontVertex{x + glyph.x0, y + glyph.y0, color, glyph.s0, glyph.t0},
+              FontVertex{x + glyph.x1, y + glyph.y0, color, glyph.s1, glyph.t0},
+              FontVertex{x + glyph.x1, y + glyph.y1, color, glyph.s1, glyph.t1},
+              FontVertex{x + glyph.x0, y + glyph.y1, color, glyph.s0, glyph.t1});
+}
+
+std::size_t text_run_size(const TextKey& key, const TextRun& run)
+{
+    return sizeof(TextKey) + sizeof(TextRun) + key.text.size() + run.vertices.size() * sizeof(FontVertex) +
+        run.draw_calls.size() * sizeof(FontDrawCall) + run.cached_chars.size() * sizeof(std::uint16_t);
+}
+
+void evict_text_run()
+{
+    auto entry = state->text_cache.find(*state->text_lru.back());
+    state->text_cache_size -= text_run_size(entry->first, entry->second);
+    state->text_lru.pop_back();
+    state->text_cache.erase(entry);
+}
+
+void clear_text_cache()
+{
+    state->text_lru.clear();
+    state->text_cache.clear();
+    state->text_cache_size = 0;
+}
+
+void add_text_run(TextKey key, std::size_t first_vertex)
+{
+    TextRun run;
+    run.vertices.assign(begin(state->font_vertices) + first_vertex, end(state->font_vertices));
+    run.draw_calls = state->text_draw_calls;
+    run.cached_chars = state->text_cached_chars;
+    auto size = text_run_size(key, run);
+    if (size > state->text_cache_capacity)
+        return;
+    while (state->text_cache_size + size > state->text_cache_capacity)
+        evict_text_run();
+    auto entry = state->text_cache.emplace(std::move(key), std::move(run)).first;
+    state->text_lru.push_front(&entry->first);
+    entry->second.lru = begin(state->text_lru);
+    state->text_cache_size += size;
+}
+
+void translate_vertices(std::vector<FontVertex>& vertices, std::size_t first_vertex, std::int64_t x, std::int64_t y)
+{
+    for (auto v = first_vertex; v < vertices.size(); ++v)
+    {
+        vertices[v].x += x;
+        vertices[v].y += y;
+    }
+}
+
+void draw_images(const std::vector<Rect>& rects, bool clear)
+{
+    if (!rects.empty())
+    {
+        set_buffer(state->image_vertex_buffer, state->image_vertices);
+        glUseProgram(state->image_program.id);
+        glUniform3fv(state->image_program.linear_background_color, 1, state->linear_clear_color.data());
+        set_vertex_attribs<ImageVertex>(IMAGE_VERTEX_ATTRIBS, state->image_vertex_buffer.buffer());
+        glActiveTexture(GL_TEXTURE0);
+        for_each_rect(rects, clear, [&]
+        {
+            for (auto& dc : state->image_draw_calls)
+            {
+                glBindTexture(GL_TEXTURE_2D, dc.texture);
+                draw_quads<ImageVertex>(IMAGE_VERTEX_ATTRIBS, state->image_vertex_buffer.buffer(), dc.offset, dc.size, STAT_IMAGE_DRAW_CALLS);
+            }
+        });
+    }
+    state->image_vertices.clear();
+    state->image_draw_calls.clear();
+}
+
+void draw_arcs(const std::vector<Rect>& rects, bool clear)
+{
+    if (!rects.empty())
+    {
+        set_buffer(state->arc_vertex_buffer, state->arc_vertices);
+        auto& program = state->direct_frame ? state->direct_arc_program : state->arc_program;
+        glUseProgram(program.id);
+        if (state->direct_frame)
+            glUniform3fv(program.background_color, 1, state->clear_color.data());
+        set_vertex_attribs<ArcVertex>(ARC_VERTEX_ATTRIBS, state->arc_vertex_buffer.buffer());
+        for_each_rect(rects, clear, [&]
+        {
+            draw_quads<ArcVertex>(ARC_VERTEX_ATTRIBS, state->arc_vertex_buffer.buffer(), 0, state->arc_vertices.size() / 4, STAT_ARC_DRAW_CALLS);
+        });
+    }
+    state->arc_vertices.clear();
+}
+
+void draw_text(const std::vector<Rect>& rects, bool clear)
+{
+    if (!rects.empty())
+    {
+        set_buffer(state->font_vertex_buffer, state->font_vertices);
+        set_vertex_attribs<FontVertex>(FONT_VERTEX_ATTRIBS, state->font_vertex_buffer.buffer());
+        glActiveTexture(GL_TEXTURE0);
+        for_each_rect(rects, clear, [&]
+        {
+            const Program *program = nullptr;
+            for (auto& dc : state->font_draw_calls)
+            {
+                auto& dc_program = state->direct_frame ?
+                    (dc.smoothing > 0 ? state->direct_sdf_program : state->direct_font_program) :
+                    (dc.smoothing > 0 ? state->sdf_program : state->font_program);
+                if (program != &dc_program)
+                {
+                    program = &dc_program;
+                    glUseProgram(program->id);
+                }
+                if (dc.smoothing > 0)
+                    glUniform1f(program->smoothing, dc.smoothing);
+                glBindTexture(GL_TEXTURE_2D, dc.texture);
+                draw_quads<FontVertex>(FONT_VERTEX_ATTRIBS, state->font_vertex_buffer.buffer(), dc.offset, dc.size, STAT_FONT_DRAW_CALLS);
+            }
+        });
+    }
+    state->font_vertices.clear();
+    state->font_draw_calls.clear();
+}
+
+void combine_layers(const std::vector<Rect>& rects)
+{
+    if (rects.empty())
+        return;
+    glUseProgram(state->combine_program.id);
+    set_vertex_attribs<CombineVertex>(COMBINE_VERTEX_ATTRIBS, state->combine_vertex_buffer);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, state->image_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, state->arc_texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, state->font_texture);
+    for_each_rect(rects, false, [&]
+    {
+        ++state->stats[STAT_COMBINE_DRAW_CALLS];
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, nullptr);
+    });
+}
+
+const std::vector<Rect>& layer_damage(std::size_t layer)
+{
+    static const std::vector<Rect> none;
+    if (state->layer_changed[layer] && !state->damage.empty())
+        return state->damage;
+    ++state->stats[STAT_SKIPPED_PASSES];
+    return none;
+}
+
+// a layer framebuffer keeps its contents from the last frame that changed it
+void render_layers()
+{
+    glDisable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, state->image_fbo);
+    glClearColor(state->clear_color[0], state->clear_color[1], state->clear_color[2], 1);
+    draw_images(layer_damage(IMAGE_LAYER), true);
+
+    glEnable(GL_BLEND);
+    glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, state->arc_fbo);
+    glClearColor(0, 0, 0, 0);
+    draw_arcs(layer_damage(ARC_LAYER), true);
+
+    glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ONE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, state->font_fbo);
+    draw_text(layer_damage(FONT_LAYER), true);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDisable(GL_BLEND);
+    if (state->screen_damage.empty())
+        ++state->stats[STAT_SKIPPED_PASSES];
+    combine_layers(state->screen_damage);
+}
+
+// what an arc quad contributes at a point, the same coverage as the arc shader
+double arc_coverage(const ArcVertex *quad, double x, double y)
+{
+    if (x < std::min(quad[0].x, quad[2].x) || x > std::max(quad[0].x, quad[2].x) ||
+        y < std::min(quad[0].y, quad[2].y) || y > std::max(quad[0].y, quad[2].y))
+        return 0;
+    auto& circle = quad[0].circle;
+    double a = std::abs(circle[2]), b = std::abs(circle[3]);
+    if (a == 0 || b == 0)
+        return 0;
+    auto t = std::min(std::max((std::hypot(x - circle[0], (y - circle[1]) * a / b) - a + 0.7071) / 1.4142, 0.0), 1.0);
+    auto sample = t * t * (3 - 2 * t);
+    return circle[2] > 0 ? 1 - sample : sample;
+}
+
+// The direct rendering shaders know the background and the arcs under text,
+// but not images, so a frame with arcs or text over an image is drawn
+// through the layers instead.
+bool draws_over_images()
+{
+    std::vector<Rect> images;
+    for (std::size_t q = 0; q + 3 < state->image_vertices.size(); q += 4)
+        images.push_back(quad_bounds(&state->image_vertices[q]));
+    if (images.empty())
+        return false;
+    auto over_image = [&](const Rect& r)
+    {
+        return std::any_of(begin(images), end(images), [&](const Rect& i)
+        {
+            return r.x0 < i.x1 && i.x0 < r.x1 && r.y0 < i.y1 && i.y0 < r.y1;
+        });
+    };
+    for (std::size_t q = 0; q + 3 < state->arc_vertices.size(); q += 4)
+        if (over_image(quad_bounds(&state->arc_vertices[q])))
+            return true;
+    for (std::size_t q = 0; q + 3 < state->font_vertices.size(); q += 4)
+        if (over_image(quad_bounds(&state->font_vertices[q])))
+            return true;
+    return false;
+}
+
+// Finds the color under the center of each glyph for the text shaders to
+// blend with in direct rendering. Arcs do not overlap one another, so the
+// first one covering the point is the only one.
+void fill_text_destinations()
+{
+    for (std::size_t q = 0; q + 3 < state->font_vertices.size(); q += 4)
+    {
+        auto glyph = &state->font_vertices[q];
+        auto x = (glyph[0].x + glyph[2].x) / 2.0, y = (glyph[0].y + glyph[2].y) / 2.0;
+        std::array<double, 3> color{{state->clear_color[0], state->clear_color[1], state->clear_color[2]}};
+        for (std::size_t a = 0; a + 3 < state->arc_vertices.size(); a += 4)
+        {
+            auto quad = &state->arc_vertices[a];
+            auto coverage = arc_coverage(quad, x, y) * quad[0].color[3] / 255;
+            if (coverage == 0)
+                continue;
+            for (std::size_t i = 0; i < 3; ++i)
+                color[i] = to_srgb(to_linear(color[i]) * (1 - coverage) + to_linear(quad[0].color[i] / 255.0) * coverage);
+            break;
+        }
+        std::array<GLubyte, 4> destination{{GLubyte(std::lround(color[0] * 255)), GLubyte(std::lround(color[1] * 255)),
+                                             GLubyte(std::lround(color[2] * 255)), 255}};
+        for (std::size_t v = 0; v < 4; ++v)
+            glyph[v].destination = destination;
+    }
+}
+
+// Draws all passes straight into the default framebuffer. Arcs and text are
+// blended in linear space as in render_layers() by shaders that know the
+// color under them: the background for arcs, and the background or the arc
+// under the center of each glyph for text.
+void render_direct()
+{
+    if (state->screen_damage.empty())
+        state->stats[STAT_SKIPPED_PASSES] += LAYER_COUNT;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDisable(GL_BLEND);
+    glClearColor(state->clear_color[0], state->clear_color[1], state->clear_color[2], 1);
+    draw_images(state->screen_damage, true);
+
+    glEnable(GL_BLEND);
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+    draw_arcs(state->screen_damage, false);
+    draw_text(state->screen_damage, false);
+    glDisable(GL_BLEND);
+}
+
+std::vector<std::uint32_t> font_charset()
+{
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    charset.push_back(0x00d7);
+    charset.push_back(0x00be);
+    charset.push_back(0x2260);
+    return charset;
+}
+
+// what a font needs from its file, prepared without touching GL or the state so it can run on the asset thread
+struct FontLoad
+{
+    std::string path;
+    std::int64_t size{}, mode{};
+    int scale{};
+    unsigned threads{};
+    bool sdf_needed{};
+    SdfFont sdf;
+    std::unique_ptr<MappedFile> cache;
+    RasterizedFont rf;
+    std::vector<const std::uint8_t *> alpha;
+    bool cached{};
+    std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+    std::size_t upload_bytes() const
+    {
+        if (mode == FONT_MODE_SDF)
+            return sdf_needed ? sdf.image.alpha.size() : 0;
+        std::size_t bytes = 0;
+        for (auto& page : rf.pages)
+            bytes += page.width * page.height;
+        return bytes;
+    }
+};
+
+std::shared_ptr<FontLoad> new_font_load(const char *path, std::int64_t size, std::int64_t mode)
+{
+    auto load = std::make_shared<FontLoad>();
+    load->path = path;
+    load->size = size;
+    load->mode = mode;
+    load->scale = state->display_scale;
+    load->threads = state->font_threads;
+    load->sdf_needed = mode == FONT_MODE_SDF && !find_sdf_face(path);
+    return load;
+}
+
+void prepare_font(FontLoad& load, FT_Library freetype, std::list<FontFile>& files)
+{
+    auto charset = font_charset();
+    auto& file = font_file(files, load.path.c_str());
+    std::vector<FT_Size> sizes;
+    if (load.mode == FONT_MODE_SDF)
+    {
+        if (!load.sdf_needed)
+            return;
+        auto faces = open_sized_faces(file, freetype, load.threads, sizes);
+        for (auto face : faces)
+            FT_Set_Char_Size(face, 0, SDF_SIZE * SDF_OVERSAMPLE * 64, 131, 142);
+        load.sdf = rasterize_sdf_font(faces, charset, 512);
+        done_sizes(sizes);
+        return;
+    }
+
+    auto cache_dir = font_cache_dir();
+    auto key = font_cache_key(file, load.size, load.scale, FONT_PRECISION, load.mode, charset);
+    auto cache_path = cache_dir.empty() || key == 0 ? std::string() : font_cache_path(cache_dir, key);
+    load.cache.reset(new MappedFile(cache_path));
+    load.cached = load_font_cache(*load.cache, key, load.rf, load.alpha);
+    if (!load.cached)
+    {
+        auto faces = open_sized_faces(file, freetype, load.threads, sizes);
+        for (auto face : faces)
+            set_font_size(face, load.size, load.mode, load.scale);
+        load.rf = rasterize_font(faces, charset, FONT_PRECISION, FONT_ATLAS_WIDTH * unsigned(load.scale), load.mode);
+        done_sizes(sizes);
+        load.alpha.clear();
+        for (auto& page : load.rf.pages)
+            load.alpha.push_back(page.alpha.data());
+        if (!cache_path.empty() && !save_font_cache(cache_path, key, load.rf))
+            std::cerr << "could not write font cache " << cache_path << std::endl;
+    }
+    else if (load.mode == FONT_MODE_LINEAR)
+        for (std::uint16_t i = 0; i < load.rf.glyphs.chars.size(); ++i)
+            share_linear_image(load.rf.glyphs, i);
+}
+
+std::size_t reserve_font()
+{
+    state->fonts.emplace_back();
+    state->fonts.back().ready = false;
+    return state->fonts.size() - 1;
+}
+
+// uploads a prepared font into its reserved slot
+void finish_font(FontLoad& load, std::size_t id)
+{
+    Font font;
+    if (load.mode == FONT_MODE_SDF)
+    {
+        auto& face = add_sdf_face(load.path, std::move(load.sdf));
+        auto scale = GLfloat(load.size * load.scale) / SDF_SIZE;
+        static_cast<FontMetrics&>(font) = sdf_font_metrics(face.font, scale, FONT_PRECISION);
+        font.textures = {face.texture};
+        font.glyphs = sdf_glyph_table(face.font, scale, FONT_PRECISION);
+        for (auto& g : font.glyphs.glyphs)
+            set_glyph_uvs(g, 0, 0, face.font.image.width, face.font.image.height);
+        // the distance changes by 127/255 over SDF_SPREAD * scale screen pixels, blend it over one pixel
+        font.smoothing = std::min(0.5f, 0.5f * 127 / (255 * SDF_SPREAD * scale));
+    }
+    else
+    {
+        font = generate_font(load.rf, load.alpha);
+        if (load.mode == FONT_MODE_LINEAR)
+            for (auto texture : font.textures)
+                set_linear_filter(texture);
+    }
+    font.path = load.path;
+    font.size = load.size;
+    font.mode = load.mode;
+    state->fonts[id] = std::move(font);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - load.start;
+
+    if (load.mode == FONT_MODE_SDF)
+    {
+        std::cout << "loaded " << load.path << " size: " << load.size << " as a distance field in " << elapsed.count() << " ms" << std::endl;
+        return;
+    }
+    auto pages = load.rf.pages.size();
+    std::cout << "loaded " << load.path << " size: " << load.size << (load.cached ? " from cache" : "") << " in " << elapsed.count() << " ms, "
+              << pages << (pages == 1 ? " page" : " pages") << " " << int(atlas_fill(load.rf) * 100 + 0.5) << "% full" << std::endl;
+}
+
+const PackedImage *find_packed_image(const std::string& path)
+{
+    auto found = state->packed_images.find(path);
+    return found == end(state->packed_images) ? nullptr : &found->second;
+}
+
+// uploads straight from the mapped pack
+Image add_packed_image(const PackedImage& image)
+{
+    return add_image(image.width, image.height, image.pixels, image.format, image.tint);
+}
+
+void add_asset_job(AssetJob job)
+{
+    if (!state->asset_loader)
+        state->asset_loader.reset(new AssetLoader);
+    auto& loader = *state->asset_loader;
+    ++state->pending_assets;
+    std::lock_guard<std::mutex> lock(loader.mutex);
+    loader.jobs.push_back(std::move(job));
+    loader.wake.notify_one();
+}
+
+// uploads finished assets until the frame's budget is spent, but at least one so a large asset is not stuck
+void upload_assets()
+{
+    if (!state->asset_loader)
+        return;
+    auto& loader = *state->asset_loader;
+    auto budget = state->asset_upload_budget;
+    for (bool first = true;; first = false)
+    {
+        AssetUpload upload;
+        {
+            std::lock_guard<std::mutex> lock(loader.mutex);
+            if (loader.uploads.empty() || (!first && loader.uploads.front().bytes > budget))
+                break;
+            upload = std::move(loader.uploads.front());
+            loader.uploads.pop_front();
+        }
+        upload.upload();
+        budget -= std::min(budget, upload.bytes);
+        state->stats[STAT_UPLOADED_BYTES] += upload.bytes;
+        --state->pending_assets;
+    }
+}
+
+}
+
+extern "C"
+{
+
+std::int64_t get_display_width()
+{
+    if (!state)
+        return 0;
+    return state->display_width;
+}
+
+std::int64_t get_display_height()
+{
+    if (!state)
+        return 0;
+    return state->display_height;
+}
+
+std::int64_t initialize_graphics(std::int64_t display_width, std::int64_t display_height, std::int64_t scale)
+{
+    std::unique_ptr<State> state{new State};
+    state->display_scale = scale;
+
+#ifndef __APPLE__
+    bcm_host_init();
+
+    graphics_get_display_size(0, &state->display_width, &state->display_height);
+
+    state->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    eglInitialize(state->display, nullptr, nullptr);
+
+    EGLint num_configs{};
+    EGLConfig config;
+    eglChooseConfig(state->display, PRESERVED_DISPLAY_ATTRIBUTES, &config, 1, &num_configs);
+    auto preserved_config = num_configs > 0;
+    if (!preserved_config)
+        eglChooseConfig(state->display, DISPLAY_ATTRIBUTES, &config, 1, &num_configs);
 
     auto context = eglCreateContext(state->display, config, EGL_NO_CONTEXT, CONTEXT_ATTRIBUTES);
 
@@ -773,6 +2087,13 @@ std::int64_t initialize_graphics(std::int64_t display_width, std::int64_t displa
     state->surface = eglCreateWindowSurface(state->display, config, &state->window, NULL);
     eglMakeCurrent(state->display, state->surface, state->surface, context);
     eglSwapInterval(state->display, 1);
+
+    state->preserved_backbuffer = preserved_config && eglSurfaceAttrib(state->display, state->surface, EGL_SWAP_BEHAVIOR, EGL_BUFFER_PRESERVED);
+    std::string egl_extensions = eglQueryString(state->display, EGL_EXTENSIONS);
+    if (egl_extensions.find("EGL_KHR_swap_buffers_with_damage") != std::string::npos)
+        state->swap_buffers_with_damage = reinterpret_cast<SwapBuffersWithDamage>(eglGetProcAddress("eglSwapBuffersWithDamageKHR"));
+    else if (egl_extensions.find("EGL_EXT_swap_buffers_with_damage") != std::string::npos)
+        state->swap_buffers_with_damage = reinterpret_cast<SwapBuffersWithDamage>(eglGetProcAddress("eglSwapBuffersWithDamageEXT"));
 #else
     state->display_width = display_width;
     state->display_height = display_height;
@@ -781,6 +2102,8 @@ std::int64_t initialize_graphics(std::int64_t display_width, std::int64_t displa
 
     std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
 
+    init_color_lookup();
+    std::cout << "sRGB conversion: " << (::state->color_lookup ? "lookup textures" : "shader math") << std::endl;
     init_shaders();
     init_buffers();
     init_framebuffers();
@@ -811,13 +2134,15 @@ std::int64_t background_color(std::int64_t r, std::int64_t g, std::int64_t b)
     if (!state)
         return 0;
     state->clear_color = {r / 255.0f, g / 255.0f, b / 255.0f};
+    state->linear_clear_color = {GLfloat(to_linear(r / 255.0)), GLfloat(to_linear(g / 255.0)), GLfloat(to_linear(b / 255.0))};
     return 0;
 }
 
 #ifndef __APPLE__
 std::int64_t clear()
 {
-    if (!state)
+    // a preserved back buffer holds the previous frame which render() only partially redraws
+    if (!state || state->preserved_backbuffer)
         return 0;
     glClearColor(0, 0, 0, 1);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -838,17 +2163,13 @@ std::int64_t arc(
     x1 *= scale; y1 *= scale;
     cx *= scale; cy *= scale; ca *= scale; cb *= scale;
 
-    std::array<GLfloat, 12> vertices{{
-        GLfloat(x0), GLfloat(y0), GLfloat(x1), GLfloat(y0), GLfloat(x1), GLfloat(y1),
-        GLfloat(x0), GLfloat(y0), GLfloat(x1), GLfloat(y1), GLfloat(x0), GLfloat(y1)}};
-    std::array<GLfloat, 4> color{{r / 255.0f, g / 255.0f, b / 255.0f, a / 255.0f}};
+    std::array<GLubyte, 4> color{{GLubyte(r), GLubyte(g), GLubyte(b), GLubyte(a)}};
     std::array<GLfloat, 4> circle{{GLfloat(cx), GLfloat(cy), GLfloat(ca), GLfloat(cb)}};
-    state->arc_vertices.insert(end(state->arc_vertices), begin(vertices), end(vertices));
-    for (int i = 0; i < 6; ++i)
-    {
-        state->arc_colors.insert(end(state->arc_colors), begin(color), end(color));
-        state->arc_circles.insert(end(state->arc_circles), begin(circle), end(circle));
-    }
+    push_quad(state->arc_vertices,
+              ArcVertex{GLfloat(x0), GLfloat(y0), color, circle},
+              ArcVertex{GLfloat(x1), GLfloat(y0), color, circle},
+              ArcVertex{GLfloat(x1), GLfloat(y1), color, circle},
+              ArcVertex{GLfloat(x0), GLfloat(y1), color, circle});
     return 0;
 }
 
@@ -861,26 +2182,61 @@ std::int64_t rect(
     return arc(x0, y0, x1, y1, r, g, b, a, x0, y0, radius, radius);
 }
 
-std::int64_t load_font(const char *filename, std::int64_t size)
+std::int64_t load_font_mode(const char *filename, std::int64_t size, std::int64_t mode)
 {
-    const unsigned PRECISION = 16;
-    FT_Face fontface;
-    FT_New_Face(::state->freetype, filename, 0, &fontface);
-    FT_Set_Char_Size(fontface, 0, size * PRECISION * state->display_scale * 64, 131, 142);
+    auto load = new_font_load(filename, size, mode);
+    prepare_font(*load, state->freetype, state->font_files);
+    auto id = reserve_font();
+    finish_font(*load, id);
+    return id;
+}
 
-    std::vector<std::uint32_t> charset;
-    for (std::uint32_t c = 32; c < 127; ++c)
-        charset.push_back(c);
-    charset.push_back(0x00d7);
-    charset.push_back(0x00be);
-    charset.push_back(0x2260);
-    ::state->fonts.push_back(generate_font(fontface, charset, PRECISION));
+std::int64_t load_font_async(const char *filename, std::int64_t size, std::int64_t mode)
+{
+    auto load = new_font_load(filename, size, mode);
+    auto id = reserve_font();
+    add_asset_job([load, id](FT_Library freetype, std::list<FontFile>& files)
+                  {
+                      prepare_font(*load, freetype, files);
+                      return AssetUpload{load->upload_bytes(), [load, id] { finish_font(*load, id); }};
+                  });
+    return id;
+}
 
-    FT_Done_Face(fontface);
+std::int64_t font_ready(std::int64_t font_id)
+{
+    return state && font_id >= 0 && std::size_t(font_id) < state->fonts.size() && state->fonts[font_id].ready;
+}
 
-    std::cout << "loaded " << filename << " size: " << size << std::endl;
+std::int64_t load_font(const char *filename, std::int64_t size)
+{
+    return load_font_mode(filename, size, FONT_MODE_OVERSAMPLE);
+}
 
-    return ::state->fonts.size() - 1;
+// loads one font per "size mode path" line, returns the id of the first, the rest follow it
+std::int64_t load_fonts(const char *spec)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto first = std::int64_t(::state->fonts.size());
+    std::istringstream lines(spec);
+    std::string line;
+    unsigned count = 0;
+    while (std::getline(lines, line))
+    {
+        std::istringstream fields(line);
+        std::int64_t size, mode;
+        std::string path;
+        if (!(fields >> size >> mode) || !std::getline(fields >> std::ws, path))
+        {
+            std::cerr << "invalid font spec: " << line << std::endl;
+            std::abort();
+        }
+        load_font_mode(path.c_str(), size, mode);
+        ++count;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "loaded " << count << " fonts from " << state->font_files.size() << " files in " << elapsed.count() << " ms" << std::endl;
+    return first;
 }
 
 std::int64_t text(
@@ -892,160 +2248,220 @@ std::int64_t text(
 {
     x *= state->display_scale; y *= state->display_scale;
     width *= state->display_scale; height *= state->display_scale;
-    const auto sc_r = c_r, sc_g = c_g, sc_b = c_b, sc_a = c_a, salign = align;
     auto& font = ::state->fonts.at(font_id);
-    auto calc_pen_x = [&](std::int64_t line_width)
-                          {
-                              switch (align)
-                              {
-                              case V_RIGHT: return (x + width) * font.precision - line_width;
-                              case V_CENTER: return (x + width / 2) * font.precision - line_width / 2;
-                              default: return x * font.precision;
-                              }
-                          };
-    auto run_modifier = [&](std::uint32_t code)
-                            {
-                                switch (code & 0xff00)
-                                {
-                                case CC_SET_ALPHA: c_a = code & 0xff; break;
-                                case CC_SET_RED: c_r = code & 0xff; break;
-                                case CC_SET_GREEN: c_g = code & 0xff; break;
-                                case CC_SET_BLUE: c_b = code & 0xff; break;
-                                case CC_RESET: c_a = sc_a; c_r = sc_r; c_g= sc_g; c_b = sc_b; align = salign; break;
-                                case CC_SET_ALIGN: align = code & 0xff; break;
-                                }
-                            };
-
-    switch (valign)
+    if (!font.ready)
+        return 0;
+    auto& vertices = ::state->font_vertices;
+    auto first_vertex = vertices.size();
+    auto draw_calls = &::state->text_draw_calls;
+    TextKey key{font_id, width, height, align, valign, {{c_r, c_g, c_b, c_a}}, text};
+    auto found = ::state->text_cache.find(key);
+    if (found != end(::state->text_cache))
     {
-    case VA_BOTTOM: y += newline_count(font, width * font.precision, text) * font.height  - font.descender; break;
-    case VA_CENTER: y += height / 2 + newline_count(font, width * font.precision, text) * font.height / 2 - font.center; break;
-    case VA_BASELINE_CENTER: y += height / 2 + newline_count(font, width * font.precision, text) * font.height / 2 - font.baseline_center; break;
-    case VA_TOP: y += height - font.ascender; break;
-    case VA_BASELINE: y += newline_count(font, width * font.precision, text) * font.height;
-    default:;
+        ++::state->frame_stats[STAT_TEXT_CACHE_HITS];
+        ::state->text_lru.splice(begin(::state->text_lru), ::state->text_lru, found->second.lru);
+        vertices.insert(end(vertices), begin(found->second.vertices), end(found->second.vertices));
+        for (auto index : found->second.cached_chars)
+            touch_glyph(font, index);
+        draw_calls = &found->second.draw_calls;
     }
-
-    auto array_offset = ::state->font_vertices.size() / 2;
-    while (*text)
+    else
     {
-        auto line = fit_text_line(font, width * font.precision, text);
-        while (text < line.end)
-        {
-            auto ch = decode_utf8_char(text);
-            if (ch.first < CC_FIRST || ch.first > CC_LAST)
-                break;
-            text += ch.second;
-            run_modifier(ch.first);
-        }
-
-        auto pen_x = calc_pen_x(line.width);
-        auto extra_width = width * font.precision - line.width;
-        auto ws_n = 0;
-        std::uint32_t prev_ch = 0;
-        while (text < line.end)
-        {
-            auto ch = decode_utf8_char(text);
-            if (ch.first >= CC_FIRST && ch.first <= CC_LAST)
-            {
-                text += ch.second;
-                run_modifier(ch.first);
-                continue;
-            }
-
-            if (font.chars.count(ch.first) == 0)
-                ch.first = '?';
-            if (prev_ch)
-                pen_x += font.kerning.at(prev_ch).at(ch.first);
-
-            pen_x += push_char(font, ch.first, pen_x, y, c_r, c_g, c_b, c_a);
-            if (align == V_JUSTIFY && ch.first == ' ' && *line.end == ' ')
-            {
-                pen_x += extra_width * (ws_n + 1) / line.ws_count - extra_width * ws_n / line.ws_count;
-                ++ws_n;
-            }
-            prev_ch = ch.first;
-            text += ch.second;
-        }
-        if (*text == '\n' || *text == ' ')
-            ++text;
-        y -= font.height;
+        ++::state->frame_stats[STAT_TEXT_CACHE_MISSES];
+        auto complete = add_missing_glyphs(font, text, ::state->text_cached_chars);
+        draw_calls->clear();
+        layout_text(font, font.glyphs, ::state->text_lines, text, width, height, align, valign, c_r, c_g, c_b, c_a,
+                    [&](const FontGlyph& glyph, GLfloat x, GLfloat y, const std::array<GLubyte, 4>& color)
+                    {
+                        add_draw_call(*draw_calls, (vertices.size() - first_vertex) / 4, 1, glyph_texture(font, glyph), font.smoothing);
+                        push_glyph(glyph, x, y, color);
+                    });
+        if (complete)
+            add_text_run(std::move(key), first_vertex);
     }
-    ::state->font_draw_calls.emplace_back(array_offset, ::state->font_vertices.size() / 2 - array_offset, font.texture);
+    translate_vertices(vertices, first_vertex, x, y);
+    for (auto& dc : *draw_calls)
+        add_draw_call(::state->font_draw_calls, first_vertex / 4 + dc.offset, dc.size, dc.texture, dc.smoothing);
     return 0;
 }
 
-std::int64_t load_image(const char *path)
+std::int64_t set_text_cache_capacity(std::int64_t capacity)
 {
-    auto fp = std::fopen(path, "rb");
-    if (!fp)
+    if (!state)
+        return 0;
+    state->text_cache_capacity = std::max<std::int64_t>(capacity, 0);
+    while (state->text_cache_size > state->text_cache_capacity)
+        evict_text_run();
+    return 0;
+}
+
+// maps a pack made by hcc_bake, load_image() takes its images from there instead of decoding the PNGs
+std::int64_t load_pack(const char *path)
+{
+    std::unique_ptr<MappedFile> pack(new MappedFile(path));
+    auto count = state->packed_images.size();
+    if (!read_asset_pack(pack->data, pack->size, state->packed_images))
     {
-        std::cerr << "error loading " << path << std::endl;
-        std::abort();
+        std::cerr << "could not load asset pack " << path << std::endl;
+        return 0;
     }
+    state->asset_packs.push_back(std::move(pack));
+    count = state->packed_images.size() - count;
+    std::cout << "loaded asset pack " << path << " with " << count << " images" << std::endl;
+    return count;
+}
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    png_infop info = png_create_info_struct(png);
-
-    if (setjmp(png_jmpbuf(png)))
+std::int64_t load_image(const char *path)
+{
+    if (auto packed = find_packed_image(path))
+        state->images.push_back(add_packed_image(*packed));
+    else
     {
-        std::cerr << "error loading " << path << std::endl;
-        std::abort();
+        auto decoded = decode_png(path);
+        state->images.push_back(add_image(decoded.width, decoded.height, decoded.rgba.data()));
     }
 
-    png_init_io(png, fp);
-    png_read_info(png, info);
+    std::cout << "loaded " << path << std::endl;
 
-    auto width = png_get_image_width(png, info);
-    auto height = png_get_image_height(png, info);
-    auto color_type = png_get_color_type(png, info);
-    auto bit_depth = png_get_bit_depth(png, info);
+    return state->images.size() - 1;
+}
 
-    if (bit_depth != 8 || (color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGBA))
+std::int64_t load_image_async(const char *path)
+{
+    std::size_t id = state->images.size();
+    state->images.emplace_back();
+    state->images.back().ready = false;
+    std::string image_path = path;
+    if (auto found = find_packed_image(path))
     {
-        std::cerr << "unsupported image format: " << path << std::endl;
-        std::abort();
+        auto packed = *found;
+        add_asset_job([packed, image_path, id](FT_Library, std::list<FontFile>&)
+                      {
+                          auto bytes = std::size_t(packed.width) * packed.height * image_format_bytes(packed.format);
+                          return AssetUpload{bytes, [packed, image_path, id]
+                                             {
+                                                 state->images[id] = add_packed_image(packed);
+                                                 std::cout << "loaded " << image_path << std::endl;
+                                             }};
+                      });
+        return id;
     }
+    add_asset_job([image_path, id](FT_Library, std::list<FontFile>&)
+                  {
+                      auto decoded = std::make_shared<DecodedImage>(decode_png(image_path.c_str()));
+                      return AssetUpload{decoded->rgba.size(), [decoded, image_path, id]
+                                         {
+                                             state->images[id] = add_image(decoded->width, decoded->height, decoded->rgba.data());
+                                             std::cout << "loaded " << image_path << std::endl;
+                                         }};
+                  });
+    return id;
+}
 
-    if (png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
-
-    if (color_type == PNG_COLOR_TYPE_RGB)
-        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
-
-    png_read_update_info(png, info);
-
-    auto rows = static_cast<png_bytep *>(std::malloc(sizeof(png_bytep) * height));
-    for (decltype(height) i = 0; i < height; ++i)
-        rows[i] = static_cast<png_byte *>(std::malloc(png_get_rowbytes(png, info)));
-
-    png_read_image(png, rows);
+std::int64_t image_ready(std::int64_t image_id)
+{
+    return state && image_id >= 0 && std::size_t(image_id) < state->images.size() && state->images[image_id].ready;
+}
 
-    std::fclose(fp);
+std::int64_t set_asset_upload_budget(std::int64_t bytes)
+{
+    if (state)
+        state->asset_upload_budget = std::max<std::int64_t>(bytes, 0);
+    return 0;
+}
 
-    std::vector<std::uint8_t> data(width * height * 4);
-    for (decltype(height) i = 0; i < height; ++i)
+// Loads a manifest of "image path" and "font size mode path" lines. The
+// assets are decoded and rasterized in parallel, one asset per thread,
+// then uploaded in manifest order. Returns the number of assets, the id
+// of each comes from preloaded_asset_id().
+std::int64_t preload_assets(const char *manifest)
+{
+    struct Asset
     {
-        std::memcpy(&data[(height - i - 1) * width * 4], rows[i], width * 4);
-        std::free(rows[i]);
+        std::string path;
+        std::shared_ptr<FontLoad> font;
+        const PackedImage *packed{};
+        DecodedImage image;
+        double ms{};
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Asset> assets;
+    std::istringstream lines(manifest);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream fields(line);
+        std::string type;
+        std::int64_t size{}, mode{};
+        Asset asset;
+        if (!(fields >> type) || (type != "image" && type != "font") || (type == "font" && !(fields >> size >> mode)) ||
+            !std::getline(fields >> std::ws, asset.path))
+        {
+            std::cerr << "invalid asset manifest line: " << line << std::endl;
+            std::abort();
+        }
+        if (type == "font")
+        {
+            asset.font = new_font_load(asset.path.c_str(), size, mode);
+            asset.font->threads = 1;
+        }
+        else
+            asset.packed = find_packed_image(asset.path);
+        assets.push_back(std::move(asset));
     }
-    std::free(rows);
 
-    GLuint texture{};
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
-
-    state->images.emplace_back(width, height, texture);
-
-    std::cout << "loaded " << path << std::endl;
+    unsigned workers = std::max<std::size_t>(std::min<std::size_t>(state->font_threads, assets.size()), 1);
+    std::vector<FT_Library> libraries(workers);
+    for (auto& library : libraries)
+        FT_Init_FreeType(&library);
+    {
+        std::vector<std::list<FontFile>> font_files(workers);
+        parallel_for(assets.size(), workers, [&](unsigned worker, std::size_t i)
+        {
+            auto& asset = assets[i];
+            auto asset_start = std::chrono::steady_clock::now();
+            if (asset.font)
+                prepare_font(*asset.font, libraries[worker], font_files[worker]);
+            else if (!asset.packed)
+                asset.image = decode_png(asset.path.c_str());
+            asset.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - asset_start).count();
+        });
+    }
+    for (auto library : libraries)
+        FT_Done_FreeType(library);
+    std::chrono::duration<double, std::milli> prepared = std::chrono::steady_clock::now() - start;
+
+    auto upload_start = std::chrono::steady_clock::now();
+    state->preloaded_ids.clear();
+    for (auto& asset : assets)
+        if (asset.font)
+        {
+            auto id = reserve_font();
+            finish_font(*asset.font, id);
+            state->preloaded_ids.push_back(id);
+        }
+        else
+        {
+            state->images.push_back(asset.packed ? add_packed_image(*asset.packed) : add_image(asset.image.width, asset.image.height, asset.image.rgba.data()));
+            state->preloaded_ids.push_back(state->images.size() - 1);
+        }
+    std::chrono::duration<double, std::milli> uploaded = std::chrono::steady_clock::now() - upload_start;
+
+    // taken while the other workers compete for the cores, so they do not add up to a sequential load
+    for (auto& asset : assets)
+        std::cout << "  " << asset.path << (asset.font ? " size: " + std::to_string(asset.font->size) : std::string()) << ": " << asset.ms << " ms" << std::endl;
+    auto total = prepared.count() + uploaded.count();
+    std::cout << "preloaded " << assets.size() << " assets on " << workers << (workers == 1 ? " thread" : " threads") << " in " << total << " ms ("
+              << prepared.count() << " ms decoding and rasterizing, " << uploaded.count() << " ms uploading)" << std::endl;
+    return assets.size();
+}
 
-    return state->images.size() - 1;
+std::int64_t preloaded_asset_id(std::int64_t index)
+{
+    if (!state || index < 0 || std::size_t(index) >= state->preloaded_ids.size())
+        return -1;
+    return state->preloaded_ids[index];
 }
 
 std::int64_t image(
@@ -1054,31 +2470,23 @@ std::int64_t image(
     std::int64_t anchor, std::int64_t vanchor)
 {
     const auto& img = ::state->images[image_id];
-    if (anchor > 0)
-        x -= img.texture_width;
-    else if (anchor == 0)
-        x -= img.texture_width / 2;
-    if (vanchor > 0)
-        y -= img.texture_height;
-    else if (vanchor == 0)
-        y -= img.texture_height / 2;
-    x *= state->display_scale;
-    y *= state->display_scale;
-    auto width = img.texture_width * state->display_scale;
-    auto height = img.texture_height * state->display_scale;
-    std::array<GLfloat, 12> vs{{
-        GLfloat(x), GLfloat(y),
-        GLfloat(x) + width, GLfloat(y),
-        GLfloat(x) + width, GLfloat(y) + height,
-        GLfloat(x), GLfloat(y),
-        GLfloat(x) + width, GLfloat(y) + height,
-        GLfloat(x), GLfloat(y) + height}};
-    std::array<GLfloat, 12> cs{{0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f}};
-
-    ::state->image_vertices.insert(::state->image_vertices.end(), vs.begin(), vs.end());
-    ::state->image_coords.insert(::state->image_coords.end(), cs.begin(), cs.end());
-    ::state->image_draw_calls.emplace_back((::state->image_vertices.size() - vs.size()) / 2, vs.size() / 2, img.texture);
+    if (!img.ready)
+        return 0;
+    push_image(img, 0, 0, img.width, img.height, x, y, anchor, vanchor);
+    return 0;
+}
 
+std::int64_t image_region(
+    std::int64_t image_id,
+    std::int64_t region_x, std::int64_t region_y,
+    std::int64_t region_width, std::int64_t region_height,
+    std::int64_t x, std::int64_t y,
+    std::int64_t anchor, std::int64_t vanchor)
+{
+    const auto& img = ::state->images[image_id];
+    if (!img.ready)
+        return 0;
+    push_image(img, region_x, region_y, region_width, region_height, x, y, anchor, vanchor);
     return 0;
 }
 
@@ -1087,101 +2495,78 @@ std::int64_t render()
     if (!state)
         return 0;
 
-    glDisable(GL_BLEND);
-    glBindFramebuffer(GL_FRAMEBUFFER, state->image_fbo);
-    glClearColor(state->clear_color[0], state->clear_color[1], state->clear_color[2], 1);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    set_buffer(state->image_vertex_buffer, state->image_vertices);
-    set_buffer(state->image_coord_buffer, state->image_coords);
-    glUseProgram(state->image_program);
-    glUniformMatrix4fv(glGetUniformLocation(state->image_program, "u_Projection"), 1, false, state->projection.data());
-    glUniform3fv(glGetUniformLocation(state->image_program, "u_BackgroundColor"), 1, state->clear_color.data());
-    set_vertex_attrib(state->image_program, "a_Position", 2, state->image_vertex_buffer);
-    set_vertex_attrib(state->image_program, "a_TexCoord", 2, state->image_coord_buffer);
-    glUniform1i(glGetUniformLocation(state->image_program, "u_Texture"), 0);
-
-    glActiveTexture(GL_TEXTURE0);
-    for (auto& dc : state->image_draw_calls)
+    state->stats = state->frame_stats;
+    state->frame_stats.fill(0);
+    std::size_t glyph_slots = 0, glyph_capacity = 0;
+    for (auto& font : state->fonts)
     {
-        glBindTexture(GL_TEXTURE_2D, dc.texture);
-        glDrawArrays(GL_TRIANGLES, dc.offset, dc.size);
+        glyph_slots += font.cache.slots.size();
+        glyph_capacity += font.cache.slots_per_page * MAX_GLYPH_PAGES;
     }
-    state->image_vertices.clear();
-    state->image_coords.clear();
-    state->image_draw_calls.clear();
-
-    glEnable(GL_BLEND);
-    glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, state->arc_fbo);
-    glClearColor(0, 0, 0, 0);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    set_buffer(state->arc_vertex_buffer, state->arc_vertices);
-    set_buffer(state->arc_color_buffer, state->arc_colors);
-    set_buffer(state->arc_circle_buffer, state->arc_circles);
-
-    glUseProgram(state->arc_program);
-    glUniformMatrix4fv(glGetUniformLocation(state->arc_program, "u_Projection"), 1, false, state->projection.data());
-    set_vertex_attrib(state->arc_program, "a_Position", 2, state->arc_vertex_buffer);
-    set_vertex_attrib(state->arc_program, "a_Color", 4, state->arc_color_buffer);
-    set_vertex_attrib(state->arc_program, "a_Circle", 4, state->arc_circle_buffer);
-
-    glDrawArrays(GL_TRIANGLES, 0, state->arc_vertices.size() / 2);
-    state->arc_vertices.clear();
-    state->arc_colors.clear();
-    state->arc_circles.clear();
-
-    glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ONE);
+    state->stats[STAT_GLYPH_ATLAS_OCCUPANCY] = glyph_capacity ? glyph_slots * 100 / glyph_capacity : 0;
+    upload_assets();
+    state->stats[STAT_PENDING_ASSETS] = state->pending_assets;
+    ++state->frame;
+    auto direct = state->direct_rendering && !draws_over_images();
+    if (!direct && !state->image_fbo)
+        init_framebuffers();
+    // the layers are stale after direct frames
+    if (!direct && state->direct_frame)
+        state->full_damage = true;
+    state->direct_frame = direct;
+    if (direct)
+        fill_text_destinations();
+    compute_layer_changes();
+    compute_damage();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state->quad_index_buffer);
+
+    glEnable(GL_SCISSOR_TEST);
+    if (direct)
+        render_direct();
+    else
+        render_layers();
+    glDisable(GL_SCISSOR_TEST);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, state->font_fbo);
-    glClearColor(0, 0, 0, 0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    set_buffer(state->font_vertex_buffer, state->font_vertices);
-    set_buffer(state->font_color_buffer, state->font_colors);
-    set_buffer(state->font_coord_buffer, state->font_coords);
+    return 0;
+}
 
-    glUseProgram(state->font_program);
-    glUniformMatrix4fv(glGetUniformLocation(state->font_program, "u_Projection"), 1, false, state->projection.data());
-    set_vertex_attrib(state->font_program, "a_Position", 2, state->font_vertex_buffer);
-    set_vertex_attrib(state->font_program, "a_Color", 4, state->font_color_buffer);
-    set_vertex_attrib(state->font_program, "a_TexCoord", 2, state->font_coord_buffer);
-    glUniform1i(glGetUniformLocation(state->font_program, "u_Texture"), 0);
+std::int64_t set_font_threads(std::int64_t threads)
+{
+    if (state)
+        state->font_threads = std::max<std::int64_t>(threads, 1);
+    return 0;
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    for (auto& dc : state->font_draw_calls)
-    {
-        glBindTexture(GL_TEXTURE_2D, dc.texture);
-        glDrawArrays(GL_TRIANGLES, dc.offset, dc.size);
-    }
-    state->font_vertices.clear();
-    state->font_colors.clear();
-    state->font_coords.clear();
-    state->font_draw_calls.clear();
+std::int64_t set_shared_font_atlas(std::int64_t enabled)
+{
+    if (state)
+        state->shared_font_atlas = enabled;
+    return 0;
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDisable(GL_BLEND);
+std::int64_t set_direct_rendering(std::int64_t enabled)
+{
+    if (!state || state->direct_rendering == bool(enabled))
+        return 0;
+    state->direct_rendering = enabled;
+    if (state->direct_rendering)
+        free_framebuffers();
+    else if (!state->image_fbo)
+        init_framebuffers();
+    state->full_damage = true;
+    return 0;
+}
 
-    std::array<GLfloat, 2> screen_size{{GLfloat(state->display_width * state->display_scale), GLfloat(state->display_height * state->display_scale)}};
-    std::array<GLfloat, 12> screen_vertices{{0, 0, screen_size[0], 0, screen_size[0], screen_size[1], 0, 0, screen_size[0], screen_size[1], 0, screen_size[1]}};
-    set_buffer(state->combine_vertex_buffer, screen_vertices);
-    glUseProgram(state->combine_program);
-    glUniformMatrix4fv(glGetUniformLocation(state->combine_program, "u_Projection"), 1, false, state->projection.data());
-    glUniform2fv(glGetUniformLocation(state->combine_program, "u_ScreenSize"), 1, screen_size.data());
-    set_vertex_attrib(state->combine_program, "a_Position", 2, state->combine_vertex_buffer);
-    glUniform1i(glGetUniformLocation(state->combine_program, "u_ImageTexture"), 0);
-    glUniform1i(glGetUniformLocation(state->combine_program, "u_ArcTexture"), 1);
-    glUniform1i(glGetUniformLocation(state->combine_program, "u_FontTexture"), 2);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, state->image_texture);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, state->arc_texture);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, state->font_texture);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+std::int64_t frame_changed()
+{
+    return state && state->frame_changed;
+}
 
-    return 0;
+std::int64_t get_render_stat(std::int64_t stat)
+{
+    if (!state || stat < 0 || stat >= STAT_COUNT)
+        return 0;
+    return state->stats[stat];
 }
 
 #ifndef __APPLE__
@@ -1189,7 +2574,24 @@ std::int64_t swap_buffers()
 {
     if (!state)
         return 0;
-    eglSwapBuffers(state->display, state->surface);
+    if (!state->frame_changed)
+    {
+        // nothing was drawn, the front buffer still shows this frame,
+        // so wait out what is left of the period a swap would have taken
+        std::this_thread::sleep_until(state->last_swap + FRAME_PERIOD);
+        state->last_swap = std::chrono::steady_clock::now();
+        return 0;
+    }
+    state->last_swap = std::chrono::steady_clock::now();
+    if (state->swap_buffers_with_damage && !state->damage.empty())
+    {
+        std::vector<EGLint> rects;
+        for (auto& r : state->damage)
+            rects.insert(end(rects), {r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0});
+        state->swap_buffers_with_damage(state->display, state->surface, rects.data(), state->damage.size());
+    }
+    else
+        eglSwapBuffers(state->display, state->surface);
     return 0;
 }
 #endif
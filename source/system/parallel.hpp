@@ -0,0 +1,31 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace hcc
+{
+
+// Calls f(worker, i) for every i in [0, count) using up to the given number
+// of threads. worker identifies the calling thread, 0 being the caller.
+template <typename F>
+void parallel_for(std::size_t count, unsigned workers, F f)
+{
+    std::atomic<std::size_t> next{0};
+    auto work = [&](unsigned worker)
+    {
+        for (auto i = next++; i < count; i = next++)
+            f(worker, i);
+    };
+    workers = unsigned(std::max<std::size_t>(std::min<std::size_t>(workers, count), 1));
+    std::vector<std::thread> threads;
+    for (unsigned worker = 1; worker < workers; ++worker)
+        threads.emplace_back(work, worker);
+    work(0);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+}
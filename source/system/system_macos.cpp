@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <cstdint>
 #include <memory>
+#include <chrono>
+#include <thread>
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
 
@@ -25,6 +27,7 @@ struct State
     bool has_input = false;
     bool touch_down = false;
     Event event;
+    std::chrono::steady_clock::time_point last_swap;
 };
 
 State *state = nullptr;
@@ -36,6 +39,7 @@ extern "C"
 
 std::int64_t initialize_graphics(std::int64_t display_width, std::int64_t display_height, std::int64_t scale);
 std::int64_t shutdown_graphics();
+std::int64_t frame_changed();
 
 std::int64_t initialize(std::int64_t display_width, std::int64_t display_height, std::int64_t scale)
 {
@@ -74,6 +78,13 @@ std::int64_t clear()
 
 std::int64_t swap_buffers()
 {
+    if (!frame_changed())
+    {
+        std::this_thread::sleep_until(state->last_swap + std::chrono::milliseconds(16));
+        state->last_swap = std::chrono::steady_clock::now();
+        return 0;
+    }
+    state->last_swap = std::chrono::steady_clock::now();
     state->window->display();
     return 0;
 }
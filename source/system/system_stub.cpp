@@ -43,11 +43,66 @@ std::int64_t load_font(const char *, std::int64_t)
     return 0;
 }
 
+std::int64_t load_font_mode(const char *, std::int64_t, std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t load_fonts(const char *)
+{
+    return 0;
+}
+
+std::int64_t load_font_async(const char *, std::int64_t, std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t font_ready(std::int64_t)
+{
+    return 1;
+}
+
+std::int64_t set_text_cache_capacity(std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t load_pack(const char *)
+{
+    return 0;
+}
+
 std::int64_t load_image(const char *)
 {
     return 0;
 }
 
+std::int64_t load_image_async(const char *)
+{
+    return 0;
+}
+
+std::int64_t image_ready(std::int64_t)
+{
+    return 1;
+}
+
+std::int64_t set_asset_upload_budget(std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t preload_assets(const char *)
+{
+    return 0;
+}
+
+std::int64_t preloaded_asset_id(std::int64_t)
+{
+    return -1;
+}
+
 std::int64_t text(std::int64_t, const char *, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t)
 {
     return 0;
@@ -58,11 +113,36 @@ std::int64_t image(std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::
     return 0;
 }
 
+std::int64_t image_region(std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t, std::int64_t)
+{
+    return 0;
+}
+
 std::int64_t swap_buffers()
 {
     return 0;
 }
 
+std::int64_t get_render_stat(std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t set_font_threads(std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t set_shared_font_atlas(std::int64_t)
+{
+    return 0;
+}
+
+std::int64_t set_direct_rendering(std::int64_t)
+{
+    return 0;
+}
+
 std::int64_t get_display_width()
 {
     return 800;
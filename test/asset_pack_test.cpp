@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+#include "asset_pack.hpp"
+#include "font.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace hcc;
+
+struct AssetPackTest : testing::Test
+{
+    std::string pack_path = std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") + "/hcc_asset_pack_test.pack";
+
+    ~AssetPackTest()
+    {
+        std::remove(pack_path.c_str());
+    }
+
+    static DecodedImage image(std::initializer_list<std::array<std::uint8_t, 4>> pixels)
+    {
+        DecodedImage img;
+        img.width = pixels.size();
+        img.height = 1;
+        img.rgba.reserve(pixels.size() * 4);
+        for (auto& p : pixels)
+            for (auto c : p)
+                img.rgba.push_back(c);
+        return img;
+    }
+};
+
+TEST_F(AssetPackTest, bake_image_should_drop_alpha_of_opaque_images)
+{
+    auto baked = bake_image("opaque", image({{{1, 2, 3, 255}}, {{4, 5, 6, 255}}}));
+
+    EXPECT_EQ(IMAGE_FORMAT_RGB, baked.format);
+    EXPECT_EQ(std::vector<std::uint8_t>({1, 2, 3, 4, 5, 6}), baked.pixels);
+}
+
+TEST_F(AssetPackTest, bake_image_should_keep_only_alpha_and_tint_of_one_color_masks)
+{
+    auto baked = bake_image("mask", image({{{40, 129, 215, 255}}, {{0, 0, 0, 0}}, {{40, 129, 215, 80}}}));
+
+    EXPECT_EQ(IMAGE_FORMAT_ALPHA, baked.format);
+    EXPECT_EQ((std::array<std::uint8_t, 3>{{40, 129, 215}}), baked.tint);
+    EXPECT_EQ(std::vector<std::uint8_t>({255, 0, 80}), baked.pixels);
+}
+
+TEST_F(AssetPackTest, bake_image_should_keep_rgba_of_translucent_images_with_more_colors)
+{
+    auto baked = bake_image("rgba", image({{{1, 2, 3, 255}}, {{4, 5, 6, 128}}}));
+
+    EXPECT_EQ(IMAGE_FORMAT_RGBA, baked.format);
+    EXPECT_EQ(std::vector<std::uint8_t>({1, 2, 3, 255, 4, 5, 6, 128}), baked.pixels);
+}
+
+TEST_F(AssetPackTest, read_asset_pack_should_point_to_the_saved_pixels)
+{
+    std::vector<BakedImage> images{
+        bake_image("a/mask.png", image({{{9, 9, 9, 10}}, {{9, 9, 9, 20}}, {{9, 9, 9, 30}}})),
+        bake_image("b/opaque.png", image({{{1, 2, 3, 255}}})),
+        bake_image("c.png", image({{{1, 2, 3, 255}}, {{4, 5, 6, 128}}}))};
+    ASSERT_TRUE(save_asset_pack(pack_path, images));
+
+    MappedFile file(pack_path);
+    std::unordered_map<std::string, PackedImage> packed;
+    ASSERT_TRUE(read_asset_pack(file.data, file.size, packed));
+
+    ASSERT_EQ(images.size(), packed.size());
+    for (auto& baked : images)
+    {
+        auto& p = packed.at(baked.name);
+        EXPECT_EQ(baked.format, p.format);
+        EXPECT_EQ(baked.width, p.width);
+        EXPECT_EQ(baked.height, p.height);
+        EXPECT_EQ(baked.tint, p.tint);
+        EXPECT_EQ(baked.pixels, std::vector<std::uint8_t>(p.pixels, p.pixels + baked.pixels.size()));
+    }
+}
+
+TEST_F(AssetPackTest, read_asset_pack_should_reject_truncated_packs)
+{
+    ASSERT_TRUE(save_asset_pack(pack_path, {bake_image("c.png", image({{{1, 2, 3, 255}}, {{4, 5, 6, 128}}}))}));
+    MappedFile file(pack_path);
+    std::unordered_map<std::string, PackedImage> packed;
+
+    EXPECT_FALSE(read_asset_pack(file.data, file.size - 1, packed));
+    EXPECT_FALSE(read_asset_pack(nullptr, 0, packed));
+    // an image count far past the end of the file
+    std::vector<std::uint8_t> data(file.data, file.data + file.size);
+    std::uint32_t count = 0xffffffff;
+    std::memcpy(data.data() + 8, &count, sizeof(count));
+    EXPECT_FALSE(read_asset_pack(data.data(), data.size(), packed));
+    EXPECT_TRUE(packed.empty());
+}
+
+TEST_F(AssetPackTest, bake_image_should_pick_the_format_of_the_assets)
+{
+    auto lock = bake_image("lock", decode_png(HCC_ASSETS_DIR "/lock.png"));
+    auto ufp = bake_image("ufp", decode_png(HCC_ASSETS_DIR "/ufp.png"));
+
+    EXPECT_EQ(IMAGE_FORMAT_ALPHA, lock.format);
+    EXPECT_EQ((std::array<std::uint8_t, 3>{{40, 129, 215}}), lock.tint);
+    EXPECT_EQ(IMAGE_FORMAT_RGBA, ufp.format);
+}
+
+TEST_F(AssetPackTest, DISABLED_png_decode_and_pack_load)
+{
+    const unsigned ROUNDS = 100;
+    std::vector<std::string> paths{HCC_ASSETS_DIR "/lock.png", HCC_ASSETS_DIR "/ufp.png"};
+    std::vector<BakedImage> images;
+    std::size_t rgba_bytes = 0, packed_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < ROUNDS; ++round)
+        for (auto& path : paths)
+            decode_png(path.c_str());
+    std::chrono::duration<double, std::milli> decode = std::chrono::steady_clock::now() - start;
+    for (auto& path : paths)
+    {
+        auto decoded = decode_png(path.c_str());
+        rgba_bytes += decoded.rgba.size();
+        images.push_back(bake_image(path, decoded));
+        packed_bytes += images.back().pixels.size();
+    }
+    ASSERT_TRUE(save_asset_pack(pack_path, images));
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < ROUNDS; ++round)
+    {
+        MappedFile file(pack_path);
+        std::unordered_map<std::string, PackedImage> packed;
+        ASSERT_TRUE(read_asset_pack(file.data, file.size, packed));
+    }
+    std::chrono::duration<double, std::milli> pack = std::chrono::steady_clock::now() - start;
+    std::cout << paths.size() << " images: png decode " << decode.count() / ROUNDS << " ms, " << rgba_bytes << " bytes to upload; "
+              << "pack load " << pack.count() / ROUNDS << " ms, " << packed_bytes << " bytes to upload" << std::endl;
+}
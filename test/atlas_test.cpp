@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+#include "atlas.hpp"
+
+using namespace hcc;
+
+struct AtlasTest : testing::Test
+{
+    struct Page
+    {
+        ShelfPacker packer;
+    };
+
+    std::vector<Page> atlas;
+};
+
+TEST_F(AtlasTest, place_in_atlas_should_grow_page_width_and_height_separately)
+{
+    AtlasPlacement placement;
+    ASSERT_TRUE(place_in_atlas(atlas, 512, 512, 4096, 800, 480, placement));
+
+    ASSERT_EQ(1u, atlas.size());
+    EXPECT_TRUE(placement.new_page);
+    EXPECT_EQ(1024u, atlas[0].packer.width);
+    EXPECT_EQ(512u, atlas[0].packer.height);
+}
+
+TEST_F(AtlasTest, atlas_coords_should_divide_by_the_page_width_and_height)
+{
+    AtlasPlacement first, second;
+    ASSERT_TRUE(place_in_atlas(atlas, 512, 512, 4096, 800, 480, first));
+    ASSERT_TRUE(place_in_atlas(atlas, 512, 512, 4096, 100, 20, second));
+    ASSERT_EQ(0u, second.page);
+    EXPECT_FALSE(second.new_page);
+
+    auto& packer = atlas[0].packer;
+    auto uv = atlas_coords(packer.width, packer.height, first.x, first.y, 800, 480);
+    EXPECT_FLOAT_EQ(0, uv.s0);
+    EXPECT_FLOAT_EQ(0, uv.t0);
+    EXPECT_FLOAT_EQ(800.0f / 1024, uv.s1);
+    EXPECT_FLOAT_EQ(480.0f / 512, uv.t1);
+
+    uv = atlas_coords(packer.width, packer.height, second.x + 10, second.y + 5, 50, 10);
+    EXPECT_FLOAT_EQ(float(second.x + 10) / 1024, uv.s0);
+    EXPECT_FLOAT_EQ(float(second.y + 5) / 512, uv.t0);
+    EXPECT_FLOAT_EQ(float(second.x + 60) / 1024, uv.s1);
+    EXPECT_FLOAT_EQ(float(second.y + 15) / 512, uv.t1);
+}
+
+TEST_F(AtlasTest, place_in_atlas_should_fail_past_the_maximum_size)
+{
+    AtlasPlacement placement;
+    EXPECT_FALSE(place_in_atlas(atlas, 512, 512, 1024, 2000, 10, placement));
+    EXPECT_TRUE(atlas.empty());
+}
@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include "color.hpp"
+#include <cmath>
+#include <cstdlib>
+
+using namespace hcc;
+
+// Models the two ways a pixel of an arc, with a glyph over it, reaches the
+// screen. The layers keep 8-bit colors and alphas and are mixed in linear
+// space by the combine shader. Direct rendering blends each one into the
+// 8-bit framebuffer with the source from linear_blend().
+struct ColorTest : testing::Test
+{
+    static int quantize(double v)
+    {
+        return int(std::lround(std::min(std::max(v, 0.0), 1.0) * 255));
+    }
+
+    static int layered(int background, int arc, double arc_alpha, int glyph, double glyph_alpha)
+    {
+        auto a = quantize(arc_alpha) / 255.0, g = quantize(glyph_alpha) / 255.0;
+        auto under = to_linear(background / 255.0) * (1 - a) + to_linear(arc / 255.0) * a;
+        return quantize(to_srgb(under * (1 - g) + to_linear(glyph / 255.0) * g));
+    }
+
+    static int direct_blend(int destination, int color, double alpha)
+    {
+        if (alpha == 0)
+            return destination;
+        auto d = destination / 255.0;
+        auto source = linear_blend({{d, d, d}}, {{color / 255.0, color / 255.0, color / 255.0}}, alpha);
+        return quantize(source[0] * source[3] + d * (1 - source[3]));
+    }
+
+    static int direct(int background, int arc, double arc_alpha, int glyph, double glyph_alpha)
+    {
+        return direct_blend(direct_blend(background, arc, arc_alpha), glyph, glyph_alpha);
+    }
+};
+
+TEST_F(ColorTest, direct_blending_should_match_the_layers_for_8_bit_alphas)
+{
+    for (int background = 0; background < 256; background += 17)
+        for (int arc = 0; arc < 256; arc += 17)
+            for (int arc_alpha = 0; arc_alpha < 256; arc_alpha += 17)
+                for (int glyph = 0; glyph < 256; glyph += 17)
+                    for (int glyph_alpha = 0; glyph_alpha < 256; glyph_alpha += 17)
+                        ASSERT_LE(std::abs(layered(background, arc, arc_alpha / 255.0, glyph, glyph_alpha / 255.0) -
+                                           direct(background, arc, arc_alpha / 255.0, glyph, glyph_alpha / 255.0)), 1)
+                            << background << " " << arc << " " << arc_alpha << " " << glyph << " " << glyph_alpha;
+}
+
+// On the edges of arcs the coverage is not a multiple of 1/255. The layers round
+// it to 8 bits while direct rendering does not, so they may differ by that rounding.
+TEST_F(ColorTest, direct_blending_should_stay_within_the_alpha_rounding_of_the_layers_on_edges)
+{
+    for (int background = 0; background < 256; background += 5)
+        for (int arc = 0; arc < 256; arc += 5)
+            for (double coverage = 0.01; coverage < 1; coverage += 0.0731)
+            {
+                auto exact = 255 * to_srgb(to_linear(background / 255.0) * (1 - coverage) + to_linear(arc / 255.0) * coverage);
+                auto layers = layered(background, arc, coverage, 0, 0);
+                auto tolerance = std::abs(layers - exact) + 1;
+                ASSERT_LE(std::abs(direct(background, arc, coverage, 0, 0) - exact), 0.5 + 1e-6)
+                    << background << " " << arc << " " << coverage;
+                ASSERT_LE(std::abs(direct(background, arc, coverage, 0, 0) - layers), tolerance)
+                    << background << " " << arc << " " << coverage;
+            }
+}
@@ -0,0 +1,1419 @@
+#include <gtest/gtest.h>
+#include "font.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <tuple>
+
+using namespace hcc;
+
+const char *const FONT_PATH = HCC_ASSETS_DIR "/Swiss 911 Ultra Compressed BT.ttf";
+
+struct FontTest : testing::Test
+{
+    static constexpr unsigned PRECISION = 4;
+
+    GlyphTable table{PRECISION};
+
+    void add_chars(std::initializer_list<std::uint32_t> codes, int advance)
+    {
+        for (auto code : codes)
+        {
+            FontChar ch;
+            ch.advance_x = advance;
+            table.add_char(code, ch);
+        }
+        table.fallback = table.index('?');
+    }
+
+    void set_kerning(std::uint32_t left, std::uint32_t right, int value)
+    {
+        table.set_kerning(table.find(left), table.find(right), value);
+    }
+};
+
+TEST_F(FontTest, should_find_latin1_and_other_chars)
+{
+    add_chars({'?', 'a', 0x2260, 0xe9, 0x00d7, 0x1f600}, 10);
+
+    EXPECT_EQ(0, table.find('?'));
+    EXPECT_EQ(1, table.find('a'));
+    EXPECT_EQ(2, table.find(0x2260));
+    EXPECT_EQ(3, table.find(0xe9));
+    EXPECT_EQ(4, table.find(0x00d7));
+    EXPECT_EQ(5, table.find(0x1f600));
+    EXPECT_EQ(GlyphTable::NONE, table.find('b'));
+    EXPECT_EQ(GlyphTable::NONE, table.find(0x2261));
+    EXPECT_EQ(table.find('?'), table.index(0x2261));
+    EXPECT_EQ(PRECISION * 6, table.glyphs.size());
+}
+
+TEST_F(FontTest, should_decode_utf8_chars)
+{
+    EXPECT_EQ(std::make_pair(std::uint32_t('a'), std::int64_t(1)), decode_utf8_char("a"));
+    EXPECT_EQ(std::make_pair(std::uint32_t(0xd7), std::int64_t(2)), decode_utf8_char("\xc3\x97"));
+    EXPECT_EQ(std::make_pair(std::uint32_t(0x2260), std::int64_t(3)), decode_utf8_char("\xe2\x89\xa0"));
+    EXPECT_EQ(std::make_pair(std::uint32_t(0x1f600), std::int64_t(4)), decode_utf8_char("\xf0\x9f\x98\x80"));
+}
+
+TEST_F(FontTest, fit_text_line_should_include_kerning)
+{
+    add_chars({'?', ' ', 'A', 'V'}, 10);
+    set_kerning('A', 'V', -3);
+
+    auto line = fit_text_line(table, 100, "AVA");
+
+    EXPECT_EQ(27, line.width);
+    EXPECT_EQ('\0', *line.end);
+}
+
+TEST_F(FontTest, fit_text_line_should_break_at_last_space)
+{
+    add_chars({'?', ' ', 'a', 'b'}, 10);
+    const char *text = "ab ab ab";
+
+    auto line = fit_text_line(table, 70, text);
+
+    EXPECT_EQ(50, line.width);
+    EXPECT_EQ(text + 5, line.end);
+    EXPECT_EQ(1, line.ws_count);
+    EXPECT_EQ(1, newline_count(table, 70, text));
+    EXPECT_EQ(2, newline_count(table, 40, text));
+    EXPECT_EQ(1, newline_count(table, 70, "ab\nab"));
+}
+
+TEST_F(FontTest, fit_text_line_should_measure_missing_chars_as_fallback)
+{
+    add_chars({'?', 'a'}, 10);
+    table.chars[table.find('?')].advance_x = 7;
+
+    EXPECT_EQ(24, fit_text_line(table, 100, "a\xe2\x89\xa0?").width);
+}
+
+TEST_F(FontTest, sparse_chars_should_reuse_removed_indices_and_keep_their_kerning)
+{
+    add_chars({'?', 'a'}, 10);
+    set_kerning('a', 'a', -1);
+    FontChar ch;
+    ch.advance_x = 20;
+    auto e = table.add_sparse_char(0xe9, ch);
+    auto ne = table.add_sparse_char(0x2260, ch);
+    table.set_kerning(table.find('a'), e, -4);
+    table.set_kerning(e, ne, -2);
+
+    EXPECT_EQ(2u, table.dense_chars);
+    EXPECT_EQ(-1, table.kern(table.find('a'), table.find('a')));
+    EXPECT_EQ(-4, table.kern(table.find('a'), e));
+    EXPECT_EQ(0, table.kern(e, table.find('a')));
+    EXPECT_EQ(44, fit_text_line(table, 100, "a\xc3\xa9\xe2\x89\xa0").width);
+
+    table.remove_sparse_char(0xe9);
+    table.remove_sparse_char('a');
+
+    EXPECT_EQ(GlyphTable::NONE, table.find(0xe9));
+    EXPECT_EQ(1, table.find('a'));
+    // only the pair of preloaded chars is left
+    EXPECT_EQ(1u, table.sparse_kerning.size());
+    EXPECT_EQ(-1, table.kern(table.find('a'), table.find('a')));
+    EXPECT_EQ(e, table.add_sparse_char(0x1f600, ch));
+    EXPECT_EQ(e, table.find(0x1f600));
+    EXPECT_EQ(4u, table.chars.size());
+}
+
+struct PlacedGlyph
+{
+    const FontGlyph *glyph{};
+    std::int64_t x{}, y{};
+    std::array<std::uint8_t, 4> color{};
+
+    bool operator==(const PlacedGlyph& other) const
+    {
+        return std::tie(glyph, x, y, color) == std::tie(other.glyph, other.x, other.y, other.color);
+    }
+};
+
+std::ostream& operator<<(std::ostream& os, const PlacedGlyph& g)
+{
+    return os << "{" << g.glyph << " " << g.x << " " << g.y << "}";
+}
+
+// the layout from before line breaking was done once per text
+std::vector<PlacedGlyph> reference_layout(
+    const FontMetrics& font, const GlyphTable& glyphs, const char *text,
+    std::int64_t width, std::int64_t height, std::int64_t align, std::int64_t valign,
+    std::int64_t c_r, std::int64_t c_g, std::int64_t c_b, std::int64_t c_a)
+{
+    std::vector<PlacedGlyph> placed;
+    std::int64_t y = 0;
+    const auto sc_r = c_r, sc_g = c_g, sc_b = c_b, sc_a = c_a, salign = align;
+    auto calc_pen_x = [&](std::int64_t line_width)
+                          {
+                              switch (align)
+                              {
+                              case V_RIGHT: return width * font.precision - line_width;
+                              case V_CENTER: return width / 2 * font.precision - line_width / 2;
+                              default: return std::int64_t(0);
+                              }
+                          };
+    auto run_modifier = [&](std::uint32_t code)
+                            {
+                                switch (code & 0xff00)
+                                {
+                                case CC_SET_ALPHA: c_a = code & 0xff; break;
+                                case CC_SET_RED: c_r = code & 0xff; break;
+                                case CC_SET_GREEN: c_g = code & 0xff; break;
+                                case CC_SET_BLUE: c_b = code & 0xff; break;
+                                case CC_RESET: c_a = sc_a; c_r = sc_r; c_g= sc_g; c_b = sc_b; align = salign; break;
+                                case CC_SET_ALIGN: align = code & 0xff; break;
+                                }
+                            };
+    auto push_char = [&](std::uint16_t index, std::int64_t pen_x)
+                         {
+                             auto& char_ = glyphs.chars[index];
+                             auto glyph_x = pen_x + char_.bearing_x;
+                             auto glyph_x_rem = ((glyph_x % font.precision) + font.precision) % font.precision;
+                             auto glyph_x_tr = (glyph_x - glyph_x_rem) / font.precision;
+                             auto bearing_y = char_.bearing_y / font.precision;
+                             std::array<std::uint8_t, 4> color{{std::uint8_t(c_r), std::uint8_t(c_g), std::uint8_t(c_b), std::uint8_t(c_a)}};
+                             placed.push_back({&glyphs.glyph(index, glyph_x_rem), glyph_x_tr, y + bearing_y, color});
+                             return char_.advance_x;
+                         };
+
+    switch (valign)
+    {
+    case VA_BOTTOM: y += newline_count(glyphs, width * font.precision, text) * font.height  - font.descender; break;
+    case VA_CENTER: y += height / 2 + newline_count(glyphs, width * font.precision, text) * font.height / 2 - font.center; break;
+    case VA_BASELINE_CENTER: y += height / 2 + newline_count(glyphs, width * font.precision, text) * font.height / 2 - font.baseline_center; break;
+    case VA_TOP: y += height - font.ascender; break;
+    case VA_BASELINE: y += newline_count(glyphs, width * font.precision, text) * font.height;
+    default:;
+    }
+
+    while (*text)
+    {
+        auto line = fit_text_line(glyphs, width * font.precision, text);
+        while (text < line.end)
+        {
+            auto ch = decode_utf8_char(text);
+            if (ch.first < CC_FIRST || ch.first > CC_LAST)
+                break;
+            text += ch.second;
+            run_modifier(ch.first);
+        }
+
+        auto pen_x = calc_pen_x(line.width);
+        auto extra_width = width * font.precision - line.width;
+        auto ws_n = 0;
+        auto prev = GlyphTable::NONE;
+        while (text < line.end)
+        {
+            auto ch = decode_utf8_char(text);
+            if (ch.first >= CC_FIRST && ch.first <= CC_LAST)
+            {
+                text += ch.second;
+                run_modifier(ch.first);
+                continue;
+            }
+
+            auto index = glyphs.index(ch.first);
+            if (prev != GlyphTable::NONE)
+                pen_x += glyphs.kern(prev, index);
+
+            pen_x += push_char(index, pen_x);
+            if (align == V_JUSTIFY && ch.first == ' ' && *line.end == ' ')
+            {
+                pen_x += extra_width * (ws_n + 1) / line.ws_count - extra_width * ws_n / line.ws_count;
+                ++ws_n;
+            }
+            prev = index;
+            text += ch.second;
+        }
+        if (*text == '\n' || *text == ' ')
+            ++text;
+        y -= font.height;
+    }
+    return placed;
+}
+
+std::string control_code(std::uint32_t code)
+{
+    return {char(0xe0 | (code >> 12)), char(0x80 | ((code >> 6) & 0x3f)), char(0x80 | (code & 0x3f))};
+}
+
+TEST_F(FontTest, layout_text_should_place_glyphs_like_the_reference_layout)
+{
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> advance(5 * PRECISION, 12 * PRECISION), bearing(-2 * PRECISION, 2 * PRECISION), kerning(-PRECISION, PRECISION);
+    for (std::uint32_t c = 32; c < 127; ++c)
+    {
+        FontChar ch;
+        ch.advance_x = advance(gen);
+        ch.bearing_x = bearing(gen);
+        ch.bearing_y = 10 * PRECISION + bearing(gen);
+        table.add_char(c, ch);
+    }
+    for (std::uint16_t left = 0; left < table.chars.size(); ++left)
+        for (std::uint16_t right = 0; right < table.chars.size(); ++right)
+            table.set_kerning(left, right, kerning(gen));
+    table.fallback = table.index('?');
+    FontMetrics font;
+    font.precision = PRECISION;
+    font.ascender = 11;
+    font.descender = -3;
+    font.height = 14;
+    font.center = 4;
+    font.baseline_center = 6;
+
+    std::vector<std::string> texts{
+        "",
+        "single",
+        "LEFT-BOTTOM\nwith\nmultiple lines and automatic line breaks breaks breaks breaks breaks breaks breaks breaks",
+        control_code(CC_SET_ALIGN | V_CENTER) + "CENTER\n" + control_code(CC_RESET) + "with " + control_code(CC_SET_RED | 0x80) + "colored" + control_code(CC_RESET) + " words and justified line breaks breaks breaks breaks",
+        "trailing newline\n",
+        "  leading and   repeated   spaces  ",
+        "averyveryverylongwordthatdoesnotfitanywhere and more",
+        "missing \xe2\x89\xa0 chars \xc3\x97 here\n\nempty line above"};
+    std::vector<TextLine> lines;
+    for (auto& text : texts)
+        for (auto width : {40, 95, 195, 1000})
+            for (auto align : {V_LEFT, V_CENTER, V_RIGHT, V_JUSTIFY})
+                for (auto valign : {VA_BOTTOM, VA_BASELINE, VA_CENTER, VA_BASELINE_CENTER, VA_TOP})
+                {
+                    std::vector<PlacedGlyph> placed;
+                    layout_text(font, table, lines, text.c_str(), width, 90, align, valign, 10, 20, 30, 255,
+                                [&](const FontGlyph& glyph, std::int64_t x, std::int64_t y, const std::array<std::uint8_t, 4>& color)
+                                {
+                                    placed.push_back({&glyph, x, y, color});
+                                });
+                    ASSERT_EQ(reference_layout(font, table, text.c_str(), width, 90, align, valign, 10, 20, 30, 255), placed)
+                        << text << " width: " << width << " align: " << align << " valign: " << valign;
+                }
+}
+
+TEST_F(FontTest, DISABLED_fit_text_line_throughput)
+{
+    for (std::uint32_t c = 32; c < 127; ++c)
+        add_chars({c}, 9 * PRECISION + c % 7);
+    std::string text;
+    for (int i = 0; i < 100; ++i)
+        text += "The quick brown fox jumps over the lazy dog. ";
+    const int N = 2000;
+    std::int64_t glyphs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; ++i)
+    {
+        const char *p = text.c_str();
+        while (*p)
+        {
+            auto line = fit_text_line(table, 400 * PRECISION, p);
+            glyphs += line.end - p;
+            p = *line.end ? line.end + 1 : line.end;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << glyphs / elapsed.count() << " glyphs/s" << std::endl;
+}
+
+TEST_F(FontTest, font_cache_should_restore_saved_font)
+{
+    RasterizedFont font;
+    font.glyphs = GlyphTable(2);
+    font.glyphs.add_char('?', {1, 2, 3});
+    font.glyphs.add_char(0x2260, {4, 5, 6});
+    font.glyphs.add_char('a', {-1, 8, 9});
+    for (std::size_t i = 0; i < font.glyphs.glyphs.size(); ++i)
+        font.glyphs.glyphs[i] = {int(i) % 3, int(i) % 2, 1, 1};
+    font.glyphs.glyphs[5] = {1, 0, 1, 1};
+    font.glyphs.glyphs[5].page = 1;
+    // pairs the way kerning_pairs() fills them, a zero one as lookups of later chars leave
+    font.glyphs.set_kerning(0, 1, 1);
+    font.glyphs.set_kerning(1, 0, 3);
+    font.glyphs.set_kerning(2, 1, 7);
+    font.glyphs.set_kerning(2, 2, -8);
+    font.glyphs.set_kerning(1, 2, 0);
+    font.metrics = {2, 11, -3, 14, 4, 6};
+    font.pages = {FontImage(4, 2), FontImage(2, 1)};
+    font.pages[0].alpha = {1, 2, 3, 4, 5, 6, 7, 8};
+    font.pages[1].alpha = {9, 10};
+    auto path = font_cache_path(std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") + "/hcc_font_test", 0x1234);
+
+    ASSERT_TRUE(save_font_cache(path, 0x1234, font));
+    RasterizedFont loaded;
+    std::vector<const std::uint8_t *> alpha;
+    MappedFile file(path);
+    ASSERT_FALSE(load_font_cache(file, 0x1235, loaded, alpha));
+    ASSERT_TRUE(load_font_cache(file, 0x1234, loaded, alpha));
+    std::remove(path.c_str());
+
+    EXPECT_EQ(1, loaded.glyphs.find(0x2260));
+    EXPECT_EQ(2, loaded.glyphs.find('a'));
+    EXPECT_EQ(0, loaded.glyphs.index('b'));
+    EXPECT_EQ(9, loaded.glyphs.chars[2].advance_x);
+    EXPECT_EQ(-1, loaded.glyphs.chars[2].bearing_x);
+    EXPECT_EQ(1, loaded.glyphs.glyph(2, 1).img_x);
+    EXPECT_EQ(1, loaded.glyphs.glyph(1, 1).img_y);
+    for (std::uint16_t left = 0; left < 3; ++left)
+        for (std::uint16_t right = 0; right < 3; ++right)
+            EXPECT_EQ(font.glyphs.kern(left, right), loaded.glyphs.kern(left, right)) << left << " " << right;
+    EXPECT_EQ(-8, loaded.glyphs.kern(2, 2));
+    EXPECT_EQ(4u, loaded.glyphs.sparse_kerning.size());
+    EXPECT_EQ(14, loaded.metrics.height);
+    EXPECT_EQ(-3, loaded.metrics.descender);
+    EXPECT_EQ(1, loaded.glyphs.glyph(2, 1).page);
+    ASSERT_EQ(2u, loaded.pages.size());
+    ASSERT_EQ(2u, alpha.size());
+    EXPECT_EQ(4u, loaded.pages[0].width);
+    EXPECT_EQ(2u, loaded.pages[0].height);
+    EXPECT_EQ(1u, loaded.pages[1].height);
+    EXPECT_EQ(font.pages[0].alpha, std::vector<std::uint8_t>(alpha[0], alpha[0] + 8));
+    EXPECT_EQ(font.pages[1].alpha, std::vector<std::uint8_t>(alpha[1], alpha[1] + 2));
+}
+
+TEST_F(FontTest, font_cache_should_reject_corrupt_files)
+{
+    auto path = font_cache_path(std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") + "/hcc_font_test", 0x4321);
+    auto make_font = []
+    {
+        RasterizedFont font;
+        font.glyphs = GlyphTable(1);
+        font.metrics.precision = 1;
+        font.glyphs.add_char('?', {1, 2, 3});
+        font.glyphs.add_char('a', {1, 2, 3});
+        font.glyphs.glyphs[1].set_image(2, 1, 2, 1);
+        font.pages = {FontImage(4, 2)};
+        return font;
+    };
+    auto loads = [&](const RasterizedFont& font, std::size_t patch_offset = 0, std::uint32_t patch = 0)
+    {
+        EXPECT_TRUE(save_font_cache(path, 0x4321, font));
+        if (patch_offset)
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(patch_offset);
+            file.write(reinterpret_cast<const char *>(&patch), sizeof(patch));
+        }
+        RasterizedFont loaded;
+        std::vector<const std::uint8_t *> alpha;
+        MappedFile file(path);
+        auto result = load_font_cache(file, 0x4321, loaded, alpha);
+        std::remove(path.c_str());
+        return result;
+    };
+
+    EXPECT_TRUE(loads(make_font()));
+    // char, page and kerning counts in the header
+    for (std::size_t offset : {40, 44, 48})
+        EXPECT_FALSE(loads(make_font(), offset, 0xffffffff)) << offset;
+    auto font = make_font();
+    font.glyphs.glyphs[1].page = 1;
+    EXPECT_FALSE(loads(font));
+    font = make_font();
+    font.glyphs.glyphs[1].set_image(3, 1, 2, 1);
+    EXPECT_FALSE(loads(font));
+    font = make_font();
+    font.glyphs.glyphs[1].set_image(2, 1, 2, 2);
+    EXPECT_FALSE(loads(font));
+}
+
+TEST_F(FontTest, DISABLED_font_cache_cold_and_warm_load)
+{
+    auto font_path = FONT_PATH;
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    auto dir = std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") + "/hcc_font_bench";
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    std::chrono::duration<double, std::milli> cold{}, warm{};
+    for (unsigned size : {27, 40, 21, 12, 9})
+    {
+        auto key = font_cache_key(font_path, size, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset);
+        auto path = font_cache_path(dir, key);
+
+        auto start = std::chrono::steady_clock::now();
+        FT_Face face;
+        FT_New_Face(freetype, font_path, 0, &face);
+        FT_Set_Char_Size(face, 0, size * PRECISION * 64, 131, 142);
+        auto font = rasterize_font({face}, charset, PRECISION, 2048, FONT_MODE_OVERSAMPLE);
+        FT_Done_Face(face);
+        save_font_cache(path, key, font);
+        cold += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        MappedFile file(path);
+        RasterizedFont loaded;
+        std::vector<const std::uint8_t *> alpha;
+        ASSERT_TRUE(load_font_cache(file, font_cache_key(font_path, size, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset), loaded, alpha));
+        warm += std::chrono::steady_clock::now() - start;
+        std::remove(path.c_str());
+    }
+    FT_Done_FreeType(freetype);
+    std::cout << "cold: " << cold.count() << " ms, warm: " << warm.count() << " ms" << std::endl;
+}
+
+RasterizedFont rasterize_with_threads(FT_Library freetype, unsigned threads, unsigned size, unsigned precision, const std::vector<std::uint32_t>& chars, int mode = FONT_MODE_OVERSAMPLE)
+{
+    std::vector<FT_Face> faces(threads);
+    for (auto& face : faces)
+    {
+        FT_New_Face(freetype, FONT_PATH, 0, &face);
+        FT_Set_Char_Size(face, 0, size * font_oversampling(mode, precision) * 64, 131, 142);
+    }
+    auto font = rasterize_font(faces, chars, precision, 2048, mode);
+    for (auto face : faces)
+        FT_Done_Face(face);
+    return font;
+}
+
+TEST_F(FontTest, font_cache_should_restore_rasterized_kerning)
+{
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    auto font = rasterize_with_threads(freetype, 1, 27, PRECISION, charset);
+    FT_Done_FreeType(freetype);
+    ASSERT_FALSE(font.glyphs.sparse_kerning.empty());
+    auto path = font_cache_path(std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp") + "/hcc_font_test", 0x5678);
+
+    ASSERT_TRUE(save_font_cache(path, 0x5678, font));
+    RasterizedFont loaded;
+    std::vector<const std::uint8_t *> alpha;
+    MappedFile file(path);
+    ASSERT_TRUE(load_font_cache(file, 0x5678, loaded, alpha));
+    std::remove(path.c_str());
+
+    EXPECT_TRUE(font.glyphs.sparse_kerning == loaded.glyphs.sparse_kerning);
+    for (std::uint16_t left = 0; left < font.glyphs.chars.size(); ++left)
+        for (std::uint16_t right = 0; right < font.glyphs.chars.size(); ++right)
+            ASSERT_EQ(font.glyphs.kern(left, right), loaded.glyphs.kern(left, right)) << left << " " << right;
+}
+
+std::size_t atlas_bytes(const RasterizedFont& font)
+{
+    std::size_t bytes = 0;
+    for (auto& page : font.pages)
+        bytes += page.width * page.height;
+    return bytes;
+}
+
+bool overlap(const PackedRect& a, const PackedRect& b)
+{
+    return a.page == b.page && a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+TEST_F(FontTest, pack_rects_should_place_rects_without_overlap_on_small_pages)
+{
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<unsigned> size(1, 40);
+    std::vector<PackedRect> rects(500);
+    std::uint64_t area = 0;
+    for (auto& r : rects)
+    {
+        r.width = size(gen);
+        r.height = size(gen);
+        area += r.width * r.height;
+    }
+    auto pages = pack_rects(rects, 2048);
+
+    ASSERT_EQ(1u, pages.size());
+    EXPECT_EQ(0u, pages[0].first & (pages[0].first - 1));
+    EXPECT_EQ(0u, pages[0].second & (pages[0].second - 1));
+    EXPECT_LE(std::uint64_t(pages[0].first) * pages[0].second, area * 2);
+    for (std::size_t i = 0; i < rects.size(); ++i)
+    {
+        ASSERT_LE(rects[i].x + rects[i].width, pages[0].first);
+        ASSERT_LE(rects[i].y + rects[i].height, pages[0].second);
+        for (std::size_t j = 0; j < i; ++j)
+            ASSERT_FALSE(overlap(rects[i], rects[j])) << i << " " << j;
+    }
+}
+
+TEST_F(FontTest, pack_rects_should_open_more_pages_when_one_is_full)
+{
+    std::vector<PackedRect> rects(10, PackedRect{30, 30});
+    auto pages = pack_rects(rects, 64);
+
+    ASSERT_EQ(3u, pages.size());
+    EXPECT_EQ(std::make_pair(64u, 64u), pages[0]);
+    EXPECT_EQ(std::make_pair(64u, 64u), pages[1]);
+    EXPECT_EQ(std::make_pair(64u, 32u), pages[2]);
+    for (std::size_t i = 0; i < rects.size(); ++i)
+    {
+        EXPECT_EQ(i / 4, rects[i].page);
+        for (std::size_t j = 0; j < i; ++j)
+            ASSERT_FALSE(overlap(rects[i], rects[j]));
+    }
+}
+
+TEST_F(FontTest, rasterize_font_should_spread_glyphs_over_pages)
+{
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    FT_Face face;
+    FT_New_Face(freetype, FONT_PATH, 0, &face);
+    FT_Set_Char_Size(face, 0, 27 * 64, 131, 142);
+    auto one_page = rasterize_font({face}, charset, PRECISION, 2048, FONT_MODE_OUTLINE);
+    auto pages = rasterize_font({face}, charset, PRECISION, 256, FONT_MODE_OUTLINE);
+    FT_Done_Face(face);
+    FT_Done_FreeType(freetype);
+
+    ASSERT_EQ(1u, one_page.pages.size());
+    EXPECT_GT(atlas_fill(one_page), 0.5);
+    EXPECT_GT(pages.pages.size(), 1u);
+    for (auto& page : pages.pages)
+        EXPECT_LE(page.width * page.height, 256u * 256);
+    EXPECT_EQ(one_page.glyphs.glyphs.size(), pages.glyphs.glyphs.size());
+    auto same_pixels = [](const RasterizedFont& a, const FontGlyph& ga, const RasterizedFont& b, const FontGlyph& gb)
+    {
+        for (int y = 0; y < ga.img_height; ++y)
+            for (int x = 0; x < ga.img_width; ++x)
+                if (a.pages[ga.page].alpha[ga.img_x + x + (ga.img_y + y) * a.pages[ga.page].width] !=
+                    b.pages[gb.page].alpha[gb.img_x + x + (gb.img_y + y) * b.pages[gb.page].width])
+                    return false;
+        return true;
+    };
+    for (std::size_t i = 0; i < pages.glyphs.glyphs.size(); ++i)
+    {
+        auto& a = one_page.glyphs.glyphs[i];
+        auto& b = pages.glyphs.glyphs[i];
+        ASSERT_EQ(std::tie(a.img_width, a.img_height), std::tie(b.img_width, b.img_height));
+        ASSERT_TRUE(same_pixels(one_page, a, pages, b)) << i;
+    }
+}
+
+// every char the font maps below U+3000 followed by unmapped ones, up to count chars
+std::vector<std::uint32_t> large_charset(FT_Face face, std::size_t count)
+{
+    std::vector<std::uint32_t> mapped, unmapped;
+    for (std::uint32_t c = 32; c < 0x3000; ++c)
+        (FT_Get_Char_Index(face, c) ? mapped : unmapped).push_back(c);
+    mapped.insert(end(mapped), begin(unmapped), end(unmapped));
+    mapped.resize(count);
+    return mapped;
+}
+
+std::vector<KerningPair> all_kerning_pairs(FT_Face face, const std::vector<std::uint32_t>& chars)
+{
+    std::vector<KerningPair> pairs;
+    for (std::size_t a = 0; a < chars.size(); ++a)
+        for (std::size_t b = 0; b < chars.size(); ++b)
+        {
+            FT_Vector k{};
+            FT_Get_Kerning(face, FT_Get_Char_Index(face, chars[a]), FT_Get_Char_Index(face, chars[b]), FT_KERNING_UNFITTED, &k);
+            if (k.x != 0)
+                pairs.push_back({std::uint16_t(a), std::uint16_t(b), k.x});
+        }
+    return pairs;
+}
+
+namespace hcc
+{
+
+bool operator==(const KerningPair& a, const KerningPair& b)
+{
+    return std::tie(a.left, a.right, a.x) == std::tie(b.left, b.right, b.x);
+}
+
+std::ostream& operator<<(std::ostream& os, const KerningPair& p)
+{
+    return os << p.left << "-" << p.right << ": " << p.x;
+}
+
+}
+
+TEST_F(FontTest, read_kern_table_should_match_ft_get_kerning)
+{
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    FT_Face face;
+    FT_New_Face(freetype, FONT_PATH, 0, &face);
+    FT_Set_Char_Size(face, 0, 27 * 64, 131, 142);
+    ASSERT_TRUE(FT_HAS_KERNING(face));
+    auto chars = large_charset(face, 300);
+    std::vector<KerningPair> pairs;
+
+    ASSERT_TRUE(read_kern_table(face, chars, pairs));
+    auto expected = all_kerning_pairs(face, chars);
+    EXPECT_FALSE(expected.empty());
+    EXPECT_EQ(expected, pairs);
+    EXPECT_EQ(expected, kerning_pairs({face}, chars));
+    FT_Done_Face(face);
+    FT_Done_FreeType(freetype);
+}
+
+void put_u16(std::vector<FT_Byte>& bytes, std::size_t at, unsigned value)
+{
+    bytes[at] = FT_Byte(value >> 8);
+    bytes[at + 1] = FT_Byte(value);
+}
+
+void put_u32(std::vector<FT_Byte>& bytes, std::size_t at, std::uint32_t value)
+{
+    put_u16(bytes, at, value >> 16);
+    put_u16(bytes, at + 2, value & 0xffff);
+}
+
+struct KernTablePair
+{
+    FT_UInt left, right;
+    int value;
+};
+
+// a format 0 kern subtable with the given coverage flags
+std::vector<FT_Byte> kern_subtable(unsigned coverage, std::vector<KernTablePair> pairs)
+{
+    std::sort(begin(pairs), end(pairs), [](const KernTablePair& a, const KernTablePair& b) { return std::tie(a.left, a.right) < std::tie(b.left, b.right); });
+    std::vector<FT_Byte> bytes(14 + pairs.size() * 6);
+    put_u16(bytes, 2, bytes.size());
+    put_u16(bytes, 4, coverage);
+    put_u16(bytes, 6, pairs.size());
+    for (std::size_t i = 0; i < pairs.size(); ++i)
+    {
+        put_u16(bytes, 14 + i * 6, pairs[i].left);
+        put_u16(bytes, 16 + i * 6, pairs[i].right);
+        put_u16(bytes, 18 + i * 6, std::uint16_t(pairs[i].value));
+    }
+    return bytes;
+}
+
+// the font file with its kern table replaced by one made of the subtables, appended at the end
+std::vector<FT_Byte> with_kern_table(const char *path, const std::vector<std::vector<FT_Byte>>& subtables)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<FT_Byte> font{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    font.resize((font.size() + 3) & ~std::size_t(3));
+    std::vector<FT_Byte> kern(4);
+    put_u16(kern, 2, subtables.size());
+    for (auto& subtable : subtables)
+        kern.insert(end(kern), begin(subtable), end(subtable));
+    unsigned table_count = font[4] << 8 | font[5];
+    for (unsigned i = 0; i < table_count; ++i)
+    {
+        auto record = 12 + i * 16;
+        if (std::equal(font.begin() + record, font.begin() + record + 4, "kern"))
+        {
+            put_u32(font, record + 8, font.size());
+            put_u32(font, record + 12, kern.size());
+        }
+    }
+    font.insert(end(font), begin(kern), end(kern));
+    return font;
+}
+
+TEST_F(FontTest, read_kern_table_should_sum_subtables_and_override_listed_pairs)
+{
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    FT_Face face;
+    FT_New_Face(freetype, FONT_PATH, 0, &face);
+    auto a = FT_Get_Char_Index(face, 'A'), t = FT_Get_Char_Index(face, 'T'), v = FT_Get_Char_Index(face, 'V');
+    FT_Done_Face(face);
+
+    auto font = with_kern_table(FONT_PATH, {
+        kern_subtable(0x0001, {{a, v, -50}, {a, t, -20}}),
+        // cross-stream and minimum values are not kerning
+        kern_subtable(0x0005, {{a, v, -1000}}),
+        kern_subtable(0x0003, {{a, t, -1000}}),
+        kern_subtable(0x0001, {{a, v, -10}, {t, a, -5}}),
+        // replaces the sum for A-T only
+        kern_subtable(0x0009, {{a, t, 30}})});
+    ASSERT_EQ(0, FT_New_Memory_Face(freetype, font.data(), font.size(), 0, &face));
+    FT_Set_Char_Size(face, 0, 27 * 64, 131, 142);
+    std::vector<std::uint32_t> chars{'A', 'T', 'V'};
+    std::vector<KerningPair> pairs;
+
+    ASSERT_TRUE(read_kern_table(face, chars, pairs));
+    auto x_scale = face->size->metrics.x_scale;
+    std::vector<KerningPair> expected{
+        {0, 1, FT_MulFix(30, x_scale)},
+        {0, 2, FT_MulFix(-60, x_scale)},
+        {1, 0, FT_MulFix(-5, x_scale)}};
+    EXPECT_EQ(expected, pairs);
+    FT_Done_Face(face);
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, DISABLED_kerning_load_time_by_charset_size)
+{
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    FT_Face face;
+    FT_New_Face(freetype, FONT_PATH, 0, &face);
+    const unsigned PRECISION = 16;
+    FT_Set_Char_Size(face, 0, 27 * PRECISION * 64, 131, 142);
+    for (std::size_t count : {95, 250, 500})
+    {
+        auto chars = large_charset(face, count);
+        auto start = std::chrono::steady_clock::now();
+        auto all = all_kerning_pairs(face, chars);
+        std::chrono::duration<double, std::milli> every_pair = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        auto pairs = kerning_pairs({face}, chars);
+        std::chrono::duration<double, std::milli> table = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        auto font = rasterize_font({face}, chars, PRECISION, 2048, FONT_MODE_OVERSAMPLE);
+        std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - start;
+        std::cout << count << " chars: every pair " << every_pair.count() << " ms, kern table " << table.count() << " ms, "
+                  << pairs.size() << " nonzero pairs, rasterize_font " << total.count() << " ms" << std::endl;
+    }
+    FT_Done_Face(face);
+    FT_Done_FreeType(freetype);
+}
+
+void expect_same_font(const RasterizedFont& expected, const RasterizedFont& actual)
+{
+    ASSERT_EQ(expected.pages.size(), actual.pages.size());
+    for (std::size_t i = 0; i < expected.pages.size(); ++i)
+        EXPECT_TRUE(expected.pages[i].alpha == actual.pages[i].alpha);
+    EXPECT_TRUE(expected.glyphs.sparse_kerning == actual.glyphs.sparse_kerning);
+    ASSERT_EQ(expected.glyphs.chars.size(), actual.glyphs.chars.size());
+    for (std::size_t i = 0; i < expected.glyphs.chars.size(); ++i)
+        ASSERT_EQ(expected.glyphs.chars[i].advance_x, actual.glyphs.chars[i].advance_x);
+    EXPECT_EQ(expected.metrics.height, actual.metrics.height);
+}
+
+TEST_F(FontTest, font_file_sizes_should_rasterize_like_separate_faces)
+{
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    {
+        FontFile file(FONT_PATH);
+        ASSERT_TRUE(file.open_faces(freetype, 2));
+        ASSERT_EQ(2u, file.faces.size());
+        EXPECT_EQ(font_cache_key(FONT_PATH, 12, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset), font_cache_key(file, 12, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset));
+
+        auto small = file.new_sizes(2);
+        ASSERT_EQ(2u, small.size());
+        for (auto face : file.faces)
+            FT_Set_Char_Size(face, 0, 12 * PRECISION * 64, 131, 142);
+        auto large = file.new_sizes(2);
+        for (auto face : file.faces)
+            FT_Set_Char_Size(face, 0, 27 * PRECISION * 64, 131, 142);
+        auto large_font = rasterize_font(file.faces, charset, PRECISION, 2048, FONT_MODE_OVERSAMPLE);
+        for (auto size : small)
+            FT_Activate_Size(size);
+        auto small_font = rasterize_font(file.faces, charset, PRECISION, 2048, FONT_MODE_OVERSAMPLE);
+        done_sizes(small);
+        done_sizes(large);
+
+        expect_same_font(rasterize_with_threads(freetype, 1, 12, PRECISION, charset), small_font);
+        expect_same_font(rasterize_with_threads(freetype, 1, 27, PRECISION, charset), large_font);
+    }
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, DISABLED_font_file_setup_per_size_faces_and_shared_mapping)
+{
+    const unsigned PRECISION = 16;
+    const unsigned THREADS = 4;
+    const unsigned ROUNDS = 20;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    std::initializer_list<unsigned> sizes{27, 40, 21, 12, 9};
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+
+    // the setup load_font_mode did before rasterizing: hash the file for the cache key, open a face per thread
+    unsigned separate_opens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < ROUNDS; ++round)
+        for (auto size : sizes)
+        {
+            font_cache_key(FONT_PATH, size, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset);
+            std::vector<FT_Face> faces(THREADS);
+            for (auto& face : faces)
+            {
+                FT_New_Face(freetype, FONT_PATH, 0, &face);
+                FT_Set_Char_Size(face, 0, size * PRECISION * 64, 131, 142);
+            }
+            for (auto face : faces)
+                FT_Done_Face(face);
+            separate_opens += 1 + THREADS;
+        }
+    std::chrono::duration<double, std::milli> separate = std::chrono::steady_clock::now() - start;
+
+    unsigned shared_opens = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < ROUNDS; ++round)
+    {
+        FontFile file(FONT_PATH);
+        file.open_faces(freetype, THREADS);
+        ++shared_opens;
+        for (auto size : sizes)
+        {
+            font_cache_key(file, size, 1, PRECISION, FONT_MODE_OVERSAMPLE, charset);
+            auto face_sizes = file.new_sizes(THREADS);
+            for (auto face : file.faces)
+                FT_Set_Char_Size(face, 0, size * PRECISION * 64, 131, 142);
+            done_sizes(face_sizes);
+        }
+    }
+    std::chrono::duration<double, std::milli> shared = std::chrono::steady_clock::now() - start;
+    FT_Done_FreeType(freetype);
+    std::cout << sizes.size() << " sizes, " << THREADS << " threads, per startup: faces per size " << separate.count() / ROUNDS << " ms, "
+              << separate_opens / ROUNDS << " file opens; shared mapping " << shared.count() / ROUNDS << " ms, "
+              << shared_opens / ROUNDS << " file open" << std::endl;
+}
+
+TEST_F(FontTest, DISABLED_atlas_fill_per_font)
+{
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (unsigned scale : {1, 2})
+        for (auto mode : {FONT_MODE_OVERSAMPLE, FONT_MODE_LINEAR})
+            for (unsigned size : {40, 27, 21, 12, 9})
+            {
+                std::vector<FT_Face> faces(1);
+                FT_New_Face(freetype, FONT_PATH, 0, &faces[0]);
+                FT_Set_Char_Size(faces[0], 0, size * scale * font_oversampling(mode, PRECISION) * 64, 131, 142);
+                auto start = std::chrono::steady_clock::now();
+                auto font = rasterize_font(faces, charset, PRECISION, 2048 * scale, mode);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                FT_Done_Face(faces[0]);
+                std::cout << "scale " << scale << (mode == FONT_MODE_LINEAR ? " linear" : " oversample") << " size " << size
+                          << ": " << font.pages.size() << " pages, " << atlas_bytes(font) << " bytes, "
+                          << atlas_fill(font) * 100 << "% full, " << elapsed.count() << " ms" << std::endl;
+            }
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, rasterize_font_should_not_depend_on_the_number_of_threads)
+{
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (auto mode : {FONT_MODE_OVERSAMPLE, FONT_MODE_OUTLINE, FONT_MODE_LINEAR})
+    {
+        auto expected = rasterize_with_threads(freetype, 1, 12, PRECISION, charset, mode);
+        auto actual = rasterize_with_threads(freetype, 3, 12, PRECISION, charset, mode);
+
+        ASSERT_EQ(charset.size(), actual.glyphs.chars.size());
+        ASSERT_EQ(expected.pages.size(), actual.pages.size());
+        for (std::size_t i = 0; i < expected.pages.size(); ++i)
+        {
+            EXPECT_EQ(expected.pages[i].width, actual.pages[i].width);
+            EXPECT_EQ(expected.pages[i].height, actual.pages[i].height);
+            EXPECT_TRUE(expected.pages[i].alpha == actual.pages[i].alpha);
+        }
+        EXPECT_TRUE(expected.glyphs.sparse_kerning == actual.glyphs.sparse_kerning);
+        for (std::size_t i = 0; i < expected.glyphs.glyphs.size(); ++i)
+        {
+            auto& e = expected.glyphs.glyphs[i];
+            auto& a = actual.glyphs.glyphs[i];
+            ASSERT_EQ(std::tie(e.img_x, e.img_y, e.img_width, e.img_height), std::tie(a.img_x, a.img_y, a.img_width, a.img_height));
+        }
+        for (std::size_t i = 0; i < expected.glyphs.chars.size(); ++i)
+            ASSERT_EQ(expected.glyphs.chars[i].advance_x, actual.glyphs.chars[i].advance_x);
+        EXPECT_EQ(expected.metrics.height, actual.metrics.height);
+    }
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, render_char_should_match_rasterize_font)
+{
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (auto mode : {FONT_MODE_OVERSAMPLE, FONT_MODE_OUTLINE})
+    {
+        auto font = rasterize_with_threads(freetype, 1, 12, PRECISION, {'A', 0xe9}, mode);
+        FT_Face face;
+        FT_New_Face(freetype, FONT_PATH, 0, &face);
+        FT_Set_Char_Size(face, 0, 12 * font_oversampling(mode, PRECISION) * 64, 131, 142);
+        FontChar metrics;
+        auto variants = render_char(face, 0xe9, PRECISION, mode, metrics);
+        EXPECT_EQ(font.glyphs.kern(0, 1), char_kerning(face, 'A', 0xe9, PRECISION, mode));
+        FT_Done_Face(face);
+
+        auto& expected = font.glyphs.chars[1];
+        EXPECT_EQ(std::tie(expected.bearing_x, expected.bearing_y, expected.advance_x), std::tie(metrics.bearing_x, metrics.bearing_y, metrics.advance_x));
+        ASSERT_EQ(std::size_t(PRECISION), variants.size());
+        for (unsigned v = 0; v < PRECISION; ++v)
+        {
+            auto& g = font.glyphs.glyph(1, v);
+            ASSERT_EQ(unsigned(g.img_width), variants[v].width);
+            ASSERT_EQ(unsigned(g.img_height), variants[v].height);
+            for (int y = 0; y < g.img_height; ++y)
+                ASSERT_TRUE(std::equal(
+                    variants[v].alpha.begin() + y * g.img_width, variants[v].alpha.begin() + (y + 1) * g.img_width,
+                    font.pages[g.page].alpha.begin() + g.img_x + (g.img_y + y) * font.pages[g.page].width));
+        }
+    }
+    FT_Done_FreeType(freetype);
+}
+
+// draws the text the way text() does, blending glyphs with max()
+std::vector<std::uint8_t> draw_text(const RasterizedFont& font, const char *text, int width, int height)
+{
+    std::vector<std::uint8_t> pixels(width * height);
+    std::vector<TextLine> lines;
+    layout_text(font.metrics, font.glyphs, lines, text, width, height, V_LEFT, VA_TOP, 255, 255, 255, 255,
+                [&](const FontGlyph& g, std::int64_t x, std::int64_t y, const std::array<std::uint8_t, 4>&)
+                {
+                    for (int gy = 0; gy < g.img_height; ++gy)
+                        for (int gx = 0; gx < g.img_width; ++gx)
+                        {
+                            auto px = x + gx, py = height - y + gy;
+                            if (px < 0 || px >= width || py < 0 || py >= height)
+                                continue;
+                            auto& page = font.pages[g.page];
+                            auto a = page.alpha[g.img_x + gx + (g.img_y + gy) * page.width];
+                            auto& p = pixels[px + py * width];
+                            p = std::max(p, a);
+                        }
+                });
+    return pixels;
+}
+
+double mean_difference(const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b)
+{
+    double sum = 0;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        sum += std::abs(int(a[i]) - int(b[i]));
+    return sum / a.size();
+}
+
+const char *const SAMPLE_TEXT = "SECURITY ACCESS 47-9315\nThe quick brown fox jumps over the lazy dog";
+
+TEST_F(FontTest, outline_mode_should_lay_out_text_like_oversampling)
+{
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    auto oversampled = rasterize_with_threads(freetype, 1, 27, PRECISION, charset, FONT_MODE_OVERSAMPLE);
+    auto outline = rasterize_with_threads(freetype, 1, 27, PRECISION, charset, FONT_MODE_OUTLINE);
+    FT_Done_FreeType(freetype);
+
+    EXPECT_EQ(oversampled.metrics.ascender, outline.metrics.ascender);
+    EXPECT_EQ(oversampled.metrics.height, outline.metrics.height);
+    for (std::size_t i = 0; i < charset.size(); ++i)
+        ASSERT_NEAR(oversampled.glyphs.chars[i].advance_x, outline.glyphs.chars[i].advance_x, 1) << char(charset[i]);
+    EXPECT_LE(atlas_bytes(outline), atlas_bytes(oversampled));
+    auto expected = draw_text(oversampled, SAMPLE_TEXT, 400, 80);
+    auto shifted = expected;
+    std::rotate(begin(shifted), end(shifted) - 1, end(shifted));
+    EXPECT_LT(mean_difference(expected, draw_text(outline, SAMPLE_TEXT, 400, 80)), mean_difference(expected, shifted) / 4);
+}
+
+void save_pgm(const std::string& fname, int width, int height, const std::vector<std::uint8_t>& pixels)
+{
+    std::ofstream f(fname, std::ios::binary);
+    f << "P5\n" << width << " " << height << "\n255\n";
+    f.write(reinterpret_cast<const char *>(pixels.data()), pixels.size());
+}
+
+TEST_F(FontTest, DISABLED_outline_mode_visual_diff_and_timing)
+{
+    const unsigned PRECISION = 16;
+    const int WIDTH = 400, HEIGHT = 80;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (auto mode : {FONT_MODE_OVERSAMPLE, FONT_MODE_OUTLINE})
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t total_bytes = 0;
+        for (unsigned size : {27, 40, 21, 12, 9})
+            total_bytes += atlas_bytes(rasterize_with_threads(freetype, 1, size, PRECISION, charset, mode));
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (mode == FONT_MODE_OUTLINE ? "outline: " : "oversample: ") << elapsed.count() << " ms, atlases: " << total_bytes << " bytes" << std::endl;
+    }
+    for (unsigned size : {27, 12})
+    {
+        auto oversampled = draw_text(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OVERSAMPLE), SAMPLE_TEXT, WIDTH, HEIGHT);
+        auto outline = draw_text(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OUTLINE), SAMPLE_TEXT, WIDTH, HEIGHT);
+        std::vector<std::uint8_t> diff(oversampled.size());
+        for (std::size_t i = 0; i < diff.size(); ++i)
+            diff[i] = std::abs(int(oversampled[i]) - int(outline[i]));
+        auto suffix = std::to_string(size) + ".pgm";
+        save_pgm("text_oversample_" + suffix, WIDTH, HEIGHT, oversampled);
+        save_pgm("text_outline_" + suffix, WIDTH, HEIGHT, outline);
+        save_pgm("text_diff_" + suffix, WIDTH, HEIGHT, diff);
+        std::cout << "size " << size << ": mean difference " << mean_difference(oversampled, outline)
+                  << ", max " << int(*std::max_element(begin(diff), end(diff))) << std::endl;
+    }
+    FT_Done_FreeType(freetype);
+}
+
+// draws the text the way text() does with LINEAR filtering, the quads only move by fractions of a pixel horizontally
+std::vector<std::uint8_t> draw_linear_text(const RasterizedFont& font, const char *text, int width, int height)
+{
+    std::vector<std::uint8_t> pixels(width * height);
+    std::vector<TextLine> lines;
+    layout_text(font.metrics, font.glyphs, lines, text, width, height, V_LEFT, VA_TOP, 255, 255, 255, 255,
+                [&](const FontGlyph& g, std::int64_t x, std::int64_t y, const std::array<std::uint8_t, 4>&)
+                {
+                    auto left = x + g.x0;
+                    auto& page = font.pages[g.page];
+                    auto texel = [&](int gx, int gy) { return gx < 0 || gx >= g.img_width ? 0 : page.alpha[g.img_x + gx + (g.img_y + gy) * page.width]; };
+                    for (int gy = 0; gy < g.img_height; ++gy)
+                        for (auto px = int(std::floor(left)); px < int(std::ceil(left + g.img_width)); ++px)
+                        {
+                            auto py = int(height - (y + g.y1)) + gy;
+                            if (px < 0 || px >= width || py < 0 || py >= height)
+                                continue;
+                            auto u = px - left;
+                            auto gx = int(std::floor(u));
+                            auto f = u - gx;
+                            auto a = std::uint8_t(std::lround((1 - f) * texel(gx, gy) + f * texel(gx + 1, gy)));
+                            auto& p = pixels[px + py * width];
+                            p = std::max(p, a);
+                        }
+                });
+    return pixels;
+}
+
+// the screen area covered by the glyph quads of the text
+double quad_area(const RasterizedFont& font, const char *text, int width, int height)
+{
+    double area = 0;
+    std::vector<TextLine> lines;
+    layout_text(font.metrics, font.glyphs, lines, text, width, height, V_LEFT, VA_TOP, 255, 255, 255, 255,
+                [&](const FontGlyph& g, std::int64_t, std::int64_t, const std::array<std::uint8_t, 4>&)
+                {
+                    area += (g.x1 - g.x0) * (g.y1 - g.y0);
+                });
+    return area;
+}
+
+TEST_F(FontTest, linear_mode_should_render_each_char_once)
+{
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    auto outline = rasterize_with_threads(freetype, 1, 27, PRECISION, charset, FONT_MODE_OUTLINE);
+    auto linear = rasterize_with_threads(freetype, 1, 27, PRECISION, charset, FONT_MODE_LINEAR);
+    FT_Done_FreeType(freetype);
+
+    EXPECT_LE(atlas_bytes(linear) * 8, atlas_bytes(outline));
+    EXPECT_EQ(outline.metrics.ascender, linear.metrics.ascender);
+    EXPECT_TRUE(outline.glyphs.sparse_kerning == linear.glyphs.sparse_kerning);
+    for (std::uint16_t i = 0; i < charset.size(); ++i)
+    {
+        ASSERT_EQ(outline.glyphs.chars[i].advance_x, linear.glyphs.chars[i].advance_x);
+        auto& first = linear.glyphs.glyph(i, 0);
+        for (unsigned v = 0; v < PRECISION; ++v)
+        {
+            auto& g = linear.glyphs.glyph(i, v);
+            ASSERT_EQ(std::tie(first.img_x, first.img_y, first.img_width, first.img_height), std::tie(g.img_x, g.img_y, g.img_width, g.img_height));
+            ASSERT_FLOAT_EQ(float(v) / PRECISION - LINEAR_PADDING, g.x0);
+            ASSERT_FLOAT_EQ(g.x0 + g.img_width, g.x1);
+        }
+    }
+    auto expected = draw_text(outline, SAMPLE_TEXT, 400, 80);
+    auto shifted = expected;
+    std::rotate(begin(shifted), end(shifted) - 1, end(shifted));
+    EXPECT_LT(mean_difference(expected, draw_linear_text(linear, SAMPLE_TEXT, 400, 80)), mean_difference(expected, shifted) / 2);
+}
+
+TEST_F(FontTest, DISABLED_linear_mode_memory_and_fill)
+{
+    const unsigned PRECISION = 16;
+    const int WIDTH = 400, HEIGHT = 80;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (auto mode : {FONT_MODE_OUTLINE, FONT_MODE_LINEAR})
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t total_bytes = 0;
+        double area = 0;
+        for (unsigned size : {27, 40, 21, 12, 9})
+        {
+            auto font = rasterize_with_threads(freetype, 1, size, PRECISION, charset, mode);
+            total_bytes += atlas_bytes(font);
+            area += quad_area(font, SAMPLE_TEXT, WIDTH, HEIGHT);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (mode == FONT_MODE_LINEAR ? "linear: " : "outline: ") << elapsed.count() << " ms, atlases: " << total_bytes
+                  << " bytes, sample text quads: " << area << " pixels" << std::endl;
+    }
+    for (unsigned size : {27, 12})
+    {
+        auto outline = draw_text(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OUTLINE), SAMPLE_TEXT, WIDTH, HEIGHT);
+        auto linear = draw_linear_text(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_LINEAR), SAMPLE_TEXT, WIDTH, HEIGHT);
+        std::vector<std::uint8_t> diff(outline.size());
+        for (std::size_t i = 0; i < diff.size(); ++i)
+            diff[i] = std::abs(int(outline[i]) - int(linear[i]));
+        auto suffix = std::to_string(size) + ".pgm";
+        save_pgm("text_linear_" + suffix, WIDTH, HEIGHT, linear);
+        save_pgm("text_linear_diff_" + suffix, WIDTH, HEIGHT, diff);
+        std::cout << "size " << size << ": mean difference " << mean_difference(outline, linear)
+                  << ", max " << int(*std::max_element(begin(diff), end(diff))) << std::endl;
+    }
+    FT_Done_FreeType(freetype);
+}
+
+SdfFont rasterize_sdf(FT_Library freetype, const std::vector<std::uint32_t>& chars)
+{
+    FT_Face face;
+    FT_New_Face(freetype, FONT_PATH, 0, &face);
+    FT_Set_Char_Size(face, 0, SDF_SIZE * SDF_OVERSAMPLE * 64, 131, 142);
+    auto font = rasterize_sdf_font({face}, chars, 512);
+    FT_Done_Face(face);
+    return font;
+}
+
+// draws the text the way the distance field shader does, sampling the atlas bilinearly
+std::vector<std::uint8_t> draw_sdf_text(const SdfFont& font, unsigned size, const char *text, int width, int height)
+{
+    const unsigned PRECISION = 16;
+    auto scale = float(size) / SDF_SIZE;
+    auto metrics = sdf_font_metrics(font, scale, PRECISION);
+    auto glyphs = sdf_glyph_table(font, scale, PRECISION);
+    auto smoothing = std::min(0.5f, 0.5f * 127 / (255 * SDF_SPREAD * scale));
+    auto& image = font.image;
+    auto sample = [&](float x, float y)
+    {
+        auto x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        auto fx = x - x0, fy = y - y0;
+        auto at = [&](int x, int y) { return float(image.alpha[x + y * image.width]); };
+        return ((1 - fx) * at(x0, y0) + fx * at(x0 + 1, y0)) * (1 - fy) + ((1 - fx) * at(x0, y0 + 1) + fx * at(x0 + 1, y0 + 1)) * fy;
+    };
+    std::vector<std::uint8_t> pixels(width * height);
+    std::vector<TextLine> lines;
+    layout_text(metrics, glyphs, lines, text, width, height, V_LEFT, VA_TOP, 255, 255, 255, 255,
+                [&](const FontGlyph& g, std::int64_t x, std::int64_t y, const std::array<std::uint8_t, 4>&)
+                {
+                    auto left = x + g.x0, top = height - (y + g.y1);
+                    auto right = x + g.x1, bottom = height - (y + g.y0);
+                    for (auto py = int(std::floor(top)); py < int(std::ceil(bottom)); ++py)
+                        for (auto px = int(std::floor(left)); px < int(std::ceil(right)); ++px)
+                        {
+                            if (px < 0 || px >= width || py < 0 || py >= height)
+                                continue;
+                            auto u = (px + 0.5f - left) / scale - 0.5f, v = (py + 0.5f - top) / scale - 0.5f;
+                            u = std::min(std::max(u, 0.0f), g.img_width - 1.001f);
+                            v = std::min(std::max(v, 0.0f), g.img_height - 1.001f);
+                            auto d = sample(g.img_x + u, g.img_y + v) / 255;
+                            auto t = std::min(std::max((d - 0.5f + smoothing) / (2 * smoothing), 0.0f), 1.0f);
+                            auto a = std::uint8_t(std::lround(t * t * (3 - 2 * t) * 255));
+                            auto& p = pixels[px + py * width];
+                            p = std::max(p, a);
+                        }
+                });
+    return pixels;
+}
+
+TEST_F(FontTest, signed_distance_field_should_be_bright_inside_and_dark_outside)
+{
+    // a 32 x 32 square at 4x oversampling is 8 x 8 pixels
+    std::vector<unsigned char> pixels(32 * 32, 255);
+    FT_Bitmap bitmap{};
+    bitmap.rows = bitmap.width = 32;
+    bitmap.pitch = 32;
+    bitmap.buffer = pixels.data();
+    int left{}, top{};
+    auto sdf = signed_distance_field(bitmap, 8, 40, 4, 4, left, top);
+
+    EXPECT_EQ(2 - 4, left);
+    EXPECT_EQ(10 + 4, top);
+    ASSERT_EQ(16u, sdf.width);
+    ASSERT_EQ(16u, sdf.height);
+    auto at = [&](int x, int y) { return int(sdf.alpha[x + y * sdf.width]); };
+    // the square covers pixels 4 to 11, the outline lies between pixels 3 and 4
+    EXPECT_NEAR(128 + 3.5 * 127 / 4, at(8, 8), 2);
+    EXPECT_EQ(0, at(0, 0));
+    EXPECT_GT(at(4, 8), 128);
+    EXPECT_LT(at(3, 8), 128);
+    EXPECT_NEAR(256, at(4, 8) + at(3, 8), 1);
+    EXPECT_LT(at(1, 8), at(2, 8));
+}
+
+TEST_F(FontTest, sdf_font_should_lay_out_text_like_oversampling)
+{
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    auto sdf = rasterize_sdf(freetype, charset);
+    for (unsigned size : {27, 12})
+    {
+        auto oversampled = rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OVERSAMPLE);
+        auto scale = float(size) / SDF_SIZE;
+        auto metrics = sdf_font_metrics(sdf, scale, PRECISION);
+        auto glyphs = sdf_glyph_table(sdf, scale, PRECISION);
+        EXPECT_NEAR(oversampled.metrics.ascender, metrics.ascender, 1);
+        EXPECT_NEAR(oversampled.metrics.height, metrics.height, 1);
+        for (std::size_t i = 0; i < charset.size(); ++i)
+            ASSERT_NEAR(oversampled.glyphs.chars[i].advance_x, glyphs.chars[i].advance_x, PRECISION) << char(charset[i]);
+        auto expected = draw_text(oversampled, SAMPLE_TEXT, 400, 80);
+        auto shifted = expected;
+        std::rotate(begin(shifted), end(shifted) - 1, end(shifted));
+        EXPECT_LT(mean_difference(expected, draw_sdf_text(sdf, size, SAMPLE_TEXT, 400, 80)), mean_difference(expected, shifted) / 2) << size;
+    }
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, DISABLED_sdf_font_memory_and_visual_diff)
+{
+    const unsigned PRECISION = 16;
+    const int WIDTH = 400, HEIGHT = 80;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    std::size_t total_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned size : {27, 40, 21, 12, 9})
+        total_bytes += atlas_bytes(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OUTLINE));
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "outline, 5 sizes: " << elapsed.count() << " ms, atlases: " << total_bytes << " bytes" << std::endl;
+    start = std::chrono::steady_clock::now();
+    auto sdf = rasterize_sdf(freetype, charset);
+    elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "sdf, all sizes: " << elapsed.count() << " ms, atlas: " << sdf.image.width * sdf.image.height << " bytes" << std::endl;
+    for (unsigned size : {40, 27, 12, 9})
+    {
+        auto oversampled = draw_text(rasterize_with_threads(freetype, 1, size, PRECISION, charset, FONT_MODE_OVERSAMPLE), SAMPLE_TEXT, WIDTH, HEIGHT);
+        auto distance = draw_sdf_text(sdf, size, SAMPLE_TEXT, WIDTH, HEIGHT);
+        std::vector<std::uint8_t> diff(oversampled.size());
+        for (std::size_t i = 0; i < diff.size(); ++i)
+            diff[i] = std::abs(int(oversampled[i]) - int(distance[i]));
+        auto suffix = std::to_string(size) + ".pgm";
+        save_pgm("text_sdf_" + suffix, WIDTH, HEIGHT, distance);
+        save_pgm("text_sdf_diff_" + suffix, WIDTH, HEIGHT, diff);
+        std::cout << "size " << size << ": mean difference " << mean_difference(oversampled, distance)
+                  << ", max " << int(*std::max_element(begin(diff), end(diff))) << std::endl;
+    }
+    FT_Done_FreeType(freetype);
+}
+
+TEST_F(FontTest, DISABLED_rasterize_font_thread_scaling)
+{
+    const unsigned PRECISION = 16;
+    std::vector<std::uint32_t> charset;
+    for (std::uint32_t c = 32; c < 127; ++c)
+        charset.push_back(c);
+    FT_Library freetype;
+    FT_Init_FreeType(&freetype);
+    for (unsigned threads : {1, 2, 4})
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned size : {27, 40, 21, 12, 9})
+            rasterize_with_threads(freetype, threads, size, PRECISION, charset);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << threads << " threads: " << elapsed.count() << " ms" << std::endl;
+    }
+    FT_Done_FreeType(freetype);
+}
+
+// downscale() before it was split into vertical and horizontal passes
+FontImage reference_downscale(FT_Bitmap bitmap, unsigned n, unsigned offset, unsigned y_offset)
+{
+    FontImage g{(bitmap.width + offset + (n - 1)) / n, (bitmap.rows + y_offset + (n - 1)) / n};
+    auto pitch = bitmap.pitch;
+    for (unsigned gy = 0; gy < g.height; ++gy)
+        for (unsigned gx = 0; gx < g.width; ++gx)
+        {
+            unsigned s = 0;
+            for (unsigned sy = (std::max(gy * n, y_offset) - y_offset) * pitch, msy = std::min((gy + 1) * n - y_offset, bitmap.rows) * pitch;
+                sy < msy;
+                sy += pitch)
+                s += std::accumulate(
+                    bitmap.buffer + std::max(gx * n, offset) - offset + sy,
+                    bitmap.buffer + std::min((gx + 1) * n - offset, bitmap.width) + sy, 0u);
+            g.alpha[gx + gy * g.width] = (s + (n * n) / 2) / (n * n);
+        }
+    return g;
+}
+
+FT_Bitmap random_bitmap(std::mt19937& gen, std::vector<unsigned char>& pixels, unsigned width, unsigned rows, unsigned padding)
+{
+    std::uniform_int_distribution<int> byte(0, 255);
+    FT_Bitmap bitmap{};
+    bitmap.width = width;
+    bitmap.rows = rows;
+    bitmap.pitch = width + padding;
+    pixels.resize(std::size_t(bitmap.pitch) * rows + 1);
+    for (auto& p : pixels)
+        p = byte(gen) < 64 ? 0 : byte(gen) < 128 ? 255 : byte(gen);
+    bitmap.buffer = pixels.data();
+    return bitmap;
+}
+
+TEST_F(FontTest, downscale_should_match_the_reference_implementation)
+{
+    std::mt19937 gen(15);
+    std::uniform_int_distribution<unsigned> size(0, 90), padding(0, 5);
+    std::vector<unsigned char> pixels;
+    for (unsigned n : {1, 2, 3, 4, 7, 16})
+        for (int i = 0; i < 20; ++i)
+        {
+            auto bitmap = random_bitmap(gen, pixels, size(gen), size(gen), padding(gen));
+            for (unsigned y_offset = 0; y_offset < n; y_offset += 1 + n / 5)
+            {
+                auto sums = sum_columns(bitmap, n, y_offset);
+                for (unsigned offset = 0; offset < n; ++offset)
+                {
+                    auto expected = reference_downscale(bitmap, n, offset, y_offset);
+                    auto actual = downscale(sums, offset);
+                    ASSERT_EQ(expected.width, actual.width);
+                    ASSERT_EQ(expected.height, actual.height);
+                    ASSERT_TRUE(expected.alpha == actual.alpha)
+                        << bitmap.width << "x" << bitmap.rows << " n: " << n << " offset: " << offset << " y_offset: " << y_offset;
+                }
+            }
+        }
+}
+
+TEST_F(FontTest, DISABLED_downscale_throughput)
+{
+    const unsigned N = 16;
+    std::mt19937 gen(15);
+    std::vector<unsigned char> pixels;
+    auto bitmap = random_bitmap(gen, pixels, 640, 640, 0);
+    const int REPEAT = 10;
+    auto mb = double(bitmap.width) * bitmap.rows * N * REPEAT / 1e6;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; ++i)
+        for (unsigned offset = 0; offset < N; ++offset)
+            reference_downscale(bitmap, N, offset, 5);
+    std::chrono::duration<double> reference = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; ++i)
+    {
+        auto sums = sum_columns(bitmap, N, 5);
+        for (unsigned offset = 0; offset < N; ++offset)
+            downscale(sums, offset);
+    }
+    std::chrono::duration<double> separable = std::chrono::steady_clock::now() - start;
+    std::cout << "reference: " << mb / reference.count() << " MB/s, separable: " << mb / separable.count() << " MB/s" << std::endl;
+}